@@ -0,0 +1,74 @@
+# frozen_string_literal: true
+
+# How late do timeouts fire? Runs expiring RubyTimeoutSafe.timeout calls under
+# different kinds of load and records the delay between each deadline and the
+# moment Timeout::Error is rescued into a Histogram.
+#
+#   rake bench   (or: ruby -Ilib benchmark/accuracy.rb [idle cpu gc io])
+#
+# ACCURACY_BUDGET   timeout of each call in seconds (default 0.002)
+# ACCURACY_SAMPLES  expiring calls per load and engine (default 2000)
+# ACCURACY_TIME     cap in seconds per load and engine (default 5)
+# ACCURACY_THREADS  background threads generating load (default 2)
+
+require_relative 'bench_helper'
+
+BUDGET = Float(ENV.fetch('ACCURACY_BUDGET', 0.002))
+SAMPLES = Integer(ENV.fetch('ACCURACY_SAMPLES', 2000))
+TIME_CAP = Float(ENV.fetch('ACCURACY_TIME', 5))
+THREADS = Integer(ENV.fetch('ACCURACY_THREADS', 2))
+
+LOADS = {
+  'idle' => nil,
+  # Sibling threads competing for the GVL.
+  'cpu' => -> { loop { 1000.times { |i| i * i } } },
+  # Constant allocation so GC runs while timeouts are pending.
+  'gc' => -> { loop { Array.new(1000) { 'garbage' * 4 } } },
+  # Threads moving data through pipes, releasing and retaking the GVL.
+  'io' => lambda do
+    reader, writer = IO.pipe
+    chunk = 'x' * 65_536
+    loop do
+      writer.write(chunk)
+      reader.read(chunk.bytesize)
+    end
+  end
+}.freeze
+
+def measure(load)
+  workers = Array.new(load ? THREADS : 0) { Thread.new(&load) }
+  histogram = RubyTimeoutSafe::Histogram.new
+  budget_ns = (BUDGET * RubyTimeoutSafe::Clock::NANOSECONDS_PER_SECOND).to_i
+  stop = RubyTimeoutSafe::Clock.now + (TIME_CAP * RubyTimeoutSafe::Clock::NANOSECONDS_PER_SECOND)
+  SAMPLES.times do
+    started = RubyTimeoutSafe::Clock.now
+    begin
+      RubyTimeoutSafe.timeout(BUDGET) { sleep }
+    rescue Timeout::Error
+      histogram.record(RubyTimeoutSafe::Clock.now - started - budget_ns)
+    end
+    break if RubyTimeoutSafe::Clock.now > stop
+  end
+  histogram
+ensure
+  workers&.each(&:kill)
+end
+
+def ms(nanoseconds)
+  format('%9.3f ms', nanoseconds / 1e6)
+end
+
+loads = ARGV.empty? ? LOADS.keys : ARGV
+engines = RubyTimeoutSafe.engines
+
+puts "Timeout overshoot, #{(BUDGET * 1000).round(3)} ms budget, #{THREADS} load threads"
+engines.each do |engine|
+  RubyTimeoutSafe.configure(engine: engine)
+  loads.each do |name|
+    histogram = measure(LOADS.fetch(name))
+    puts format('  %-8<engine>s %-5<load>s n=%-6<count>d p50 %<p50>s  p99 %<p99>s  p999 %<p999>s  max %<max>s',
+                engine: engine, load: name, count: histogram.count,
+                p50: ms(histogram.percentile(50)), p99: ms(histogram.percentile(99)),
+                p999: ms(histogram.percentile(99.9)), max: ms(histogram.max))
+  end
+end
@@ -0,0 +1,113 @@
+# frozen_string_literal: true
+
+# A small benchmark-ips style harness so the benchmarks only need the standard
+# library. BENCH_TIME sets the seconds measured per report (default 2).
+
+require 'timeout'
+require 'ruby_timeout_safe'
+
+module Bench
+  TIME = Float(ENV.fetch('BENCH_TIME', 2))
+  WARMUP = TIME / 4
+
+  # Collects the reports of one comparison.
+  class Job
+    attr_reader :reports
+
+    def initialize
+      @reports = []
+    end
+
+    # Measures +block+; with +threads+ it runs on that many threads at once
+    # and reports their combined rate.
+    def report(label, threads: 1, &block)
+      @reports << [label, threads, block]
+    end
+  end
+
+  def self.now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  # Iterations per second of each report, with a comparison against the fastest.
+  def self.ips(title)
+    job = Job.new
+    yield job
+    puts title
+    results = job.reports.map do |label, threads, block|
+      run_for(WARMUP, threads, &block)
+      rate = run_for(TIME, threads, &block) / TIME
+      puts format('  %-36<label>s %14<rate>s i/s', label: label, rate: format_rate(rate))
+      [label, rate]
+    end
+    compare(results)
+    puts
+  end
+
+  # Objects allocated per call of each report.
+  def self.allocations(title, calls: 10_000)
+    job = Job.new
+    yield job
+    puts title
+    job.reports.each do |label, _threads, block|
+      calls.times(&block)
+      before = GC.stat(:total_allocated_objects)
+      calls.times(&block)
+      per_call = (GC.stat(:total_allocated_objects) - before).fdiv(calls)
+      puts format('  %-36<label>s %10.2<per_call>f objects/call', label: label, per_call: per_call)
+    end
+    puts
+  end
+
+  # Delay between the deadline and the moment Timeout::Error is rescued.
+  def self.latency(title, budget:, samples: 200)
+    job = Job.new
+    yield job
+    puts "#{title} (#{(budget * 1000).round(1)} ms budget)"
+    job.reports.each do |label, _threads, block|
+      delays = Array.new(samples) do
+        started = now
+        begin
+          block.call
+        rescue Timeout::Error
+          nil
+        end
+        now - started - budget
+      end.sort
+      puts format('  %-36<label>s p50 %8.3<p50>f ms  p99 %8.3<p99>f ms  max %8.3<max>f ms',
+                  label: label, p50: delays[samples / 2] * 1000, p99: delays[(samples * 0.99).floor] * 1000,
+                  max: delays.last * 1000)
+    end
+    puts
+  end
+
+  def self.run_for(seconds, threads, &block)
+    stop = now + seconds
+    counts = Array.new(threads) do
+      Thread.new do
+        count = 0
+        while now < stop
+          100.times(&block)
+          count += 100
+        end
+        count
+      end
+    end
+    counts.sum(&:value)
+  end
+
+  def self.compare(results)
+    return if results.size < 2
+
+    _, best = results.max_by(&:last)
+    results.each do |label, rate|
+      next if rate == best
+
+      puts format('  %-36<label>s %.2<ratio>fx slower', label: label, ratio: best / rate)
+    end
+  end
+
+  def self.format_rate(rate)
+    rate.round.to_s.reverse.scan(/\d{1,3}/).join(',').reverse
+  end
+end
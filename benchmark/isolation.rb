@@ -0,0 +1,40 @@
+# frozen_string_literal: true
+
+# Cost of timeout(..., isolate: :process), a fork, a pipe and a Marshal round
+# trip per call, and of a WorkerPool call, which skips the fork, against the
+# in-thread scope, to decide per call site.
+#
+#   ruby -Ilib benchmark/isolation.rb
+
+require_relative 'bench_helper'
+
+puts "Ruby #{RUBY_VERSION}, #{GC.stat(:heap_live_slots)} live objects in the parent"
+puts
+
+pool = RubyTimeoutSafe::WorkerPool.new(size: 1) { |value| value }
+
+Bench.ips('block returns nil') do |x|
+  x.report('in-thread') { RubyTimeoutSafe.timeout(1) { nil } }
+  x.report('WorkerPool#call') { pool.call(nil, timeout: 1) }
+  x.report('isolate: :process') { RubyTimeoutSafe.timeout(1, isolate: :process) { nil } }
+end
+
+payload = 'x' * (1024 * 1024)
+Bench.ips('block returns a 1 MB string') do |x|
+  x.report('in-thread') { RubyTimeoutSafe.timeout(1) { payload.dup } }
+  x.report('WorkerPool#call') { pool.call(payload, timeout: 1) }
+  x.report('isolate: :process') { RubyTimeoutSafe.timeout(1, isolate: :process) { payload } }
+end
+
+# A larger heap makes fork copy more page tables.
+ballast = Array.new(1_000_000) { |i| "object #{i}" }
+Bench.ips("block returns nil, #{ballast.size} extra live objects") do |x|
+  x.report('isolate: :process') { RubyTimeoutSafe.timeout(1, isolate: :process) { nil } }
+end
+
+Bench.latency('fired timeout latency', budget: 0.01, samples: 50) do |x|
+  x.report('in-thread') { RubyTimeoutSafe.timeout(0.01) { sleep 1 } }
+  x.report('isolate: :process') { RubyTimeoutSafe.timeout(0.01, isolate: :process) { sleep 1 } }
+end
+
+pool.shutdown
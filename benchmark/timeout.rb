@@ -0,0 +1,83 @@
+# frozen_string_literal: true
+
+# RubyTimeoutSafe.timeout against the standard library's Timeout.timeout.
+#
+#   rake bench   (or: ruby -Ilib benchmark/timeout.rb)
+
+require_relative 'bench_helper'
+
+puts "Ruby #{RUBY_VERSION}, engine #{RubyTimeoutSafe.settings[:engine]} " \
+     "(native: #{RubyTimeoutSafe.native?}), store #{RubyTimeoutSafe.settings[:store]}"
+puts
+
+Bench.ips('fast path: block completes immediately') do |x|
+  x.report('RubyTimeoutSafe.timeout') { RubyTimeoutSafe.timeout(1) { nil } }
+  x.report('Timeout.timeout') { Timeout.timeout(1) { nil } }
+end
+
+Bench.ips('three nested scopes') do |x|
+  x.report('RubyTimeoutSafe.timeout') do
+    RubyTimeoutSafe.timeout(1) { RubyTimeoutSafe.timeout(2) { RubyTimeoutSafe.timeout(3) { nil } } }
+  end
+  x.report('Timeout.timeout') do
+    Timeout.timeout(1) { Timeout.timeout(2) { Timeout.timeout(3) { nil } } }
+  end
+end
+
+[1, 8, 64].each do |threads|
+  Bench.ips("fast path on #{threads} concurrent thread#{'s' unless threads == 1}") do |x|
+    x.report('RubyTimeoutSafe.timeout', threads: threads) { RubyTimeoutSafe.timeout(1) { nil } }
+    x.report('Timeout.timeout', threads: threads) { Timeout.timeout(1) { nil } }
+  end
+end
+
+Bench.allocations('allocated objects per call') do |x|
+  x.report('RubyTimeoutSafe.timeout') { RubyTimeoutSafe.timeout(1) { nil } }
+  x.report('Timeout.timeout') { Timeout.timeout(1) { nil } }
+end
+
+Bench.latency('fired timeout latency', budget: 0.01) do |x|
+  x.report('RubyTimeoutSafe.timeout') { RubyTimeoutSafe.timeout(0.01) { sleep 1 } }
+  x.report('Timeout.timeout') { Timeout.timeout(0.01) { sleep 1 } }
+end
+
+if RubyTimeoutSafe::IOTimeout.supported?
+  reader, _writer = IO.pipe
+  Bench.latency('fired timeout latency, blocked reading a pipe', budget: 0.01) do |x|
+    x.report('watchdog Thread#raise') { RubyTimeoutSafe.timeout(0.01) { reader.gets } }
+    x.report('io: true (bounded wait)') { RubyTimeoutSafe.timeout(0.01, io: true) { reader.gets } }
+  end
+end
+
+# Reports run on threads of their own, so each iteration enters a scope and
+# checks 1,000 times inside it.
+Bench.ips('1,000 checkpoints inside a scope') do |x|
+  x.report('RubyTimeoutSafe.check!') do
+    RubyTimeoutSafe.timeout(60, mode: :cooperative) { 1000.times { RubyTimeoutSafe.check! } }
+  end
+  x.report('current_deadline.expired?') do
+    RubyTimeoutSafe.timeout(60, mode: :cooperative) { 1000.times { RubyTimeoutSafe.current_deadline.expired? } }
+  end
+end
+
+Bench.ips('critical section') do |x|
+  x.report('RubyTimeoutSafe.critical') { RubyTimeoutSafe.critical { nil } }
+end
+
+# The thread per item that a plain fan-out with Timeout.timeout takes.
+items = (1..100).to_a
+Bench.ips('fanning out 100 short items') do |x|
+  x.report('RubyTimeoutSafe.map, concurrency 16') do
+    RubyTimeoutSafe.map(items, timeout: 5, per_item: 1, concurrency: 16) { |item| item }
+  end
+  x.report('thread per item with Timeout.timeout') do
+    items.map { |item| Thread.new { Timeout.timeout(1) { item } } }.each(&:join)
+  end
+end
+
+# Compare with the fast path above, which runs without subscribers.
+stats = RubyTimeoutSafe.subscribe(RubyTimeoutSafe::Stats.new)
+Bench.ips('fast path with a Stats subscriber') do |x|
+  x.report('RubyTimeoutSafe.timeout') { RubyTimeoutSafe.timeout(1) { nil } }
+end
+RubyTimeoutSafe.unsubscribe(stats)
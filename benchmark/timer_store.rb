@@ -0,0 +1,61 @@
+# frozen_string_literal: true
+
+# Compares the deadline stores behind the watchdog: steady-state churn where
+# scopes finish before their deadline (the common case), and register then
+# expire.
+#
+#   rake bench   (or: ruby -Ilib benchmark/timer_store.rb)
+
+require 'benchmark'
+require 'ruby_timeout_safe'
+
+ITERATIONS = 200_000
+STORES = {
+  'heap' => -> { RubyTimeoutSafe::TimerHeap.new },
+  'wheel' => -> { RubyTimeoutSafe::TimingWheel.new }
+}.freeze
+
+def timer(deadline)
+  RubyTimeoutSafe::Timer.new(Thread.current, deadline)
+end
+
+now = RubyTimeoutSafe::Clock.now
+second = RubyTimeoutSafe::Clock::NANOSECONDS_PER_SECOND
+
+[1_000, 10_000, 100_000].each do |in_flight|
+  puts "register + cancel, #{in_flight} timers in flight"
+  Benchmark.bm(8) do |x|
+    STORES.each do |name, build|
+      store = build.call
+      random = Random.new(42)
+      in_flight_timers = Array.new(in_flight) { store.push(timer(now + second + random.rand(second))) }
+      timers = Array.new(ITERATIONS) { timer(now + second + random.rand(second)) }
+      x.report(name) do
+        timers.each_with_index do |t, i|
+          # The oldest scope finishes and a new one starts in its place.
+          slot = i % in_flight
+          store.delete(in_flight_timers[slot])
+          in_flight_timers[slot] = store.push(t)
+        end
+      end
+      in_flight_timers.each { |t| store.delete(t) }
+    end
+  end
+  puts
+end
+
+puts "register + expire, #{ITERATIONS} timers over one second"
+Benchmark.bm(8) do |x|
+  STORES.each do |name, build|
+    store = build.call
+    timers = Array.new(ITERATIONS) { |i| timer(now + (i * (second / ITERATIONS))) }
+    x.report(name) do
+      timers.each { |t| store.push(t) }
+      at = now
+      until store.empty?
+        at += 1_000_000
+        store.expire(at) { |_t| nil }
+      end
+    end
+  end
+end
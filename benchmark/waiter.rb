@@ -0,0 +1,72 @@
+# frozen_string_literal: true
+
+# Wakeup latency of the watchdog waiters: how long after an armed deadline the
+# waiting thread is running again. The polling loop is the sleep(0.05) loop
+# the watchdog used before it had waiters.
+#
+#   ruby -Ilib benchmark/waiter.rb
+#
+# WAITER_SAMPLES  wakeups per waiter and case (default 200)
+# WAITER_DELAY    seconds between arming and the deadline (default 0.002)
+
+require_relative 'bench_helper'
+
+SAMPLES = Integer(ENV.fetch('WAITER_SAMPLES', 200))
+DELAY = (Float(ENV.fetch('WAITER_DELAY', 0.002)) * RubyTimeoutSafe::Clock::NANOSECONDS_PER_SECOND).to_i
+
+# The waiter interface over a fixed-period polling loop.
+class PollingWaiter
+  def arm(deadline)
+    @deadline = deadline
+  end
+
+  def wait
+    sleep(0.05) while @deadline.nil? || RubyTimeoutSafe::Clock.now < @deadline
+  end
+end
+
+WAITERS = { 'sleep(0.05) loop' => PollingWaiter, 'ruby' => RubyTimeoutSafe::Waiter }
+WAITERS['condvar'] = RubyTimeoutSafe::Native::CondvarWaiter if RubyTimeoutSafe.engines.include?(:condvar)
+WAITERS['timerfd'] = RubyTimeoutSafe::Native::TimerfdWaiter if RubyTimeoutSafe.engines.include?(:timerfd)
+
+# Arms before waiting.
+def armed_wakeup(waiter)
+  deadline = RubyTimeoutSafe::Clock.now + DELAY
+  waiter.arm(deadline)
+  waiter.wait
+  RubyTimeoutSafe::Clock.now - deadline
+end
+
+# Arms from another thread while the waiter is blocked with no deadline, the
+# way a new scope reaches a sleeping watchdog.
+def rearmed_wakeup(waiter)
+  waiter.arm(nil)
+  deadline = nil
+  arming = Thread.new do
+    sleep 0.001
+    deadline = RubyTimeoutSafe::Clock.now + DELAY
+    waiter.arm(deadline)
+  end
+  waiter.wait
+  woke = RubyTimeoutSafe::Clock.now
+  arming.join
+  woke - deadline
+end
+
+def ms(nanoseconds)
+  format('%8.3f ms', nanoseconds / 1e6)
+end
+
+puts "Waiter wakeup latency, deadline #{ms(DELAY).strip} after arming"
+{ 'armed before wait' => :armed_wakeup, 'armed while waiting' => :rearmed_wakeup }.each do |name, measure|
+  puts name
+  WAITERS.each do |label, waiter_class|
+    waiter = waiter_class.new
+    histogram = RubyTimeoutSafe::Histogram.new
+    samples = waiter_class == PollingWaiter ? SAMPLES / 10 : SAMPLES
+    samples.times { histogram.record(send(measure, waiter)) }
+    puts format('  %-18<label>s p50 %<p50>s  p99 %<p99>s  max %<max>s',
+                label: label, p50: ms(histogram.percentile(50)), p99: ms(histogram.percentile(99)),
+                max: ms(histogram.max))
+  end
+end
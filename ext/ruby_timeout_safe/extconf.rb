@@ -0,0 +1,20 @@
+# frozen_string_literal: true
+
+require 'mkmf'
+
+# The extension is optional: without pthreads an empty Makefile is written and
+# RubyTimeoutSafe falls back to its pure-Ruby engine.
+if have_header('pthread.h') && have_func('clock_gettime', 'time.h')
+  have_func('pthread_condattr_setclock', 'pthread.h')
+  have_func('pthread_getcpuclockid', 'pthread.h')
+  # SignalTimer; older glibc keeps POSIX timers in librt.
+  have_func('timer_create', 'time.h') || (have_library('rt') && have_func('timer_create', 'time.h'))
+  # TimerfdWaiter.
+  have_header('sys/timerfd.h')
+  have_header('sys/epoll.h')
+  have_header('sys/eventfd.h')
+  $CFLAGS << ' -std=c99 -Wall'
+  create_makefile('ruby_timeout_safe/ruby_timeout_safe')
+else
+  File.write('Makefile', dummy_makefile($srcdir).join)
+end
@@ -0,0 +1,558 @@
+/*
+ * Native waiters for the RubyTimeoutSafe watchdog.
+ *
+ * The watchdog thread blocks in a waiter until the earliest armed deadline
+ * passes. Waiting happens on a pthread condition variable with the GVL
+ * released, so the watchdog neither polls nor competes with application
+ * threads for the GVL; it only re-enters Ruby to deliver an interrupt.
+ *
+ * On Linux, TimerfdWaiter does the same with a single timerfd and epoll, and
+ * SignalTimer lets a timed-out thread be kicked out of a blocking system call
+ * that Ruby cannot interrupt.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <ruby.h>
+#include <ruby/thread.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(HAVE_TIMER_CREATE) && defined(__linux__)
+#include <signal.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifdef SIGEV_THREAD_ID
+#define RTS_SIGNAL_TIMER 1
+#endif
+#endif
+
+#if defined(HAVE_SYS_TIMERFD_H) && defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#define RTS_TIMERFD_WAITER 1
+#endif
+
+#define NSEC_PER_SEC 1000000000LL
+#define DISARMED -1
+
+static int64_t rts_monotonic_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static int64_t rts_deadline_value(VALUE deadline)
+{
+    return NIL_P(deadline) ? DISARMED : (int64_t)NUM2LL(deadline);
+}
+
+/* CondvarWaiter */
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int64_t deadline; /* monotonic ns, or DISARMED */
+    int interrupted;
+} rts_condvar_waiter;
+
+static void rts_condvar_waiter_free(void *ptr)
+{
+    rts_condvar_waiter *waiter = ptr;
+
+    pthread_cond_destroy(&waiter->cond);
+    pthread_mutex_destroy(&waiter->lock);
+    xfree(waiter);
+}
+
+static size_t rts_condvar_waiter_memsize(const void *ptr)
+{
+    return sizeof(rts_condvar_waiter);
+}
+
+static const rb_data_type_t rts_condvar_waiter_type = {
+    "RubyTimeoutSafe::Native::CondvarWaiter",
+    { NULL, rts_condvar_waiter_free, rts_condvar_waiter_memsize },
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE rts_condvar_waiter_alloc(VALUE klass)
+{
+    rts_condvar_waiter *waiter;
+    pthread_condattr_t attr;
+    VALUE self = TypedData_Make_Struct(klass, rts_condvar_waiter, &rts_condvar_waiter_type, waiter);
+
+    pthread_mutex_init(&waiter->lock, NULL);
+    pthread_condattr_init(&attr);
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&waiter->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    waiter->deadline = DISARMED;
+    waiter->interrupted = 0;
+    return self;
+}
+
+static struct timespec rts_condvar_abstime(int64_t deadline)
+{
+    struct timespec ts;
+
+#ifndef HAVE_PTHREAD_CONDATTR_SETCLOCK
+    /* The condition variable runs on CLOCK_REALTIME here. */
+    clock_gettime(CLOCK_REALTIME, &ts);
+    deadline += (int64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec - rts_monotonic_now();
+#endif
+    ts.tv_sec = (time_t)(deadline / NSEC_PER_SEC);
+    ts.tv_nsec = (long)(deadline % NSEC_PER_SEC);
+    return ts;
+}
+
+static void *rts_condvar_waiter_wait_nogvl(void *ptr)
+{
+    rts_condvar_waiter *waiter = ptr;
+
+    pthread_mutex_lock(&waiter->lock);
+    while (!waiter->interrupted) {
+        int64_t deadline = waiter->deadline;
+
+        if (deadline == DISARMED) {
+            pthread_cond_wait(&waiter->cond, &waiter->lock);
+        } else if (rts_monotonic_now() >= deadline) {
+            break;
+        } else {
+            struct timespec abstime = rts_condvar_abstime(deadline);
+            pthread_cond_timedwait(&waiter->cond, &waiter->lock, &abstime);
+        }
+    }
+    pthread_mutex_unlock(&waiter->lock);
+    return NULL;
+}
+
+static void rts_condvar_waiter_unblock(void *ptr)
+{
+    rts_condvar_waiter *waiter = ptr;
+
+    pthread_mutex_lock(&waiter->lock);
+    waiter->interrupted = 1;
+    pthread_cond_signal(&waiter->cond);
+    pthread_mutex_unlock(&waiter->lock);
+}
+
+/*
+ * call-seq: arm(deadline) -> nil
+ *
+ * Sets the deadline (monotonic nanoseconds) #wait returns at, or disarms the
+ * waiter when +deadline+ is nil. Wakes a waiting thread so it picks up the
+ * new deadline.
+ */
+static VALUE rts_condvar_waiter_arm(VALUE self, VALUE deadline)
+{
+    rts_condvar_waiter *waiter;
+    int64_t value = rts_deadline_value(deadline);
+
+    TypedData_Get_Struct(self, rts_condvar_waiter, &rts_condvar_waiter_type, waiter);
+    pthread_mutex_lock(&waiter->lock);
+    waiter->deadline = value;
+    pthread_cond_signal(&waiter->cond);
+    pthread_mutex_unlock(&waiter->lock);
+    return Qnil;
+}
+
+/*
+ * call-seq: wait -> nil
+ *
+ * Blocks without the GVL until the armed deadline passes. Returns early when
+ * the calling thread is interrupted (Thread#raise, Thread#kill).
+ */
+static VALUE rts_condvar_waiter_wait(VALUE self)
+{
+    rts_condvar_waiter *waiter;
+
+    TypedData_Get_Struct(self, rts_condvar_waiter, &rts_condvar_waiter_type, waiter);
+    pthread_mutex_lock(&waiter->lock);
+    waiter->interrupted = 0;
+    pthread_mutex_unlock(&waiter->lock);
+    rb_thread_call_without_gvl(rts_condvar_waiter_wait_nogvl, waiter, rts_condvar_waiter_unblock, waiter);
+    return Qnil;
+}
+
+#ifdef HAVE_PTHREAD_GETCPUCLOCKID
+/*
+ * call-seq: thread_cpu_clock_id -> integer
+ *
+ * The clock id of the calling thread's CPU-time clock. Any thread can pass
+ * it to Process.clock_gettime to see how much CPU the caller has used.
+ */
+static VALUE rts_thread_cpu_clock_id(VALUE self)
+{
+    clockid_t clock;
+    int error = pthread_getcpuclockid(pthread_self(), &clock);
+
+    if (error != 0) {
+        errno = error;
+        rb_sys_fail("pthread_getcpuclockid");
+    }
+    return LONG2NUM((long)clock);
+}
+#endif
+
+/* TimerfdWaiter */
+
+#ifdef RTS_TIMERFD_WAITER
+typedef struct {
+    int epoll;
+    int timer;  /* timerfd, armed with the deadline */
+    int wakeup; /* eventfd, written by the unblocking function */
+} rts_timerfd_waiter;
+
+static void rts_timerfd_waiter_close(rts_timerfd_waiter *waiter)
+{
+    if (waiter->wakeup >= 0) close(waiter->wakeup);
+    if (waiter->timer >= 0) close(waiter->timer);
+    if (waiter->epoll >= 0) close(waiter->epoll);
+    waiter->epoll = waiter->timer = waiter->wakeup = -1;
+}
+
+static void rts_timerfd_waiter_free(void *ptr)
+{
+    rts_timerfd_waiter *waiter = ptr;
+
+    rts_timerfd_waiter_close(waiter);
+    xfree(waiter);
+}
+
+static size_t rts_timerfd_waiter_memsize(const void *ptr)
+{
+    return sizeof(rts_timerfd_waiter);
+}
+
+static const rb_data_type_t rts_timerfd_waiter_type = {
+    "RubyTimeoutSafe::Native::TimerfdWaiter",
+    { NULL, rts_timerfd_waiter_free, rts_timerfd_waiter_memsize },
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE rts_timerfd_waiter_alloc(VALUE klass)
+{
+    rts_timerfd_waiter *waiter;
+    VALUE self = TypedData_Make_Struct(klass, rts_timerfd_waiter, &rts_timerfd_waiter_type, waiter);
+
+    waiter->epoll = waiter->timer = waiter->wakeup = -1;
+    return self;
+}
+
+static int rts_timerfd_waiter_watch(rts_timerfd_waiter *waiter, int fd)
+{
+    struct epoll_event event;
+
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    return epoll_ctl(waiter->epoll, EPOLL_CTL_ADD, fd, &event);
+}
+
+/*
+ * call-seq: new -> timerfd_waiter
+ *
+ * Opens the epoll instance, the timerfd and the eventfd used to interrupt a
+ * wait.
+ */
+static VALUE rts_timerfd_waiter_initialize(VALUE self)
+{
+    rts_timerfd_waiter *waiter;
+
+    TypedData_Get_Struct(self, rts_timerfd_waiter, &rts_timerfd_waiter_type, waiter);
+    waiter->epoll = epoll_create1(EPOLL_CLOEXEC);
+    waiter->timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    waiter->wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (waiter->epoll < 0 || waiter->timer < 0 || waiter->wakeup < 0 ||
+        rts_timerfd_waiter_watch(waiter, waiter->timer) != 0 ||
+        rts_timerfd_waiter_watch(waiter, waiter->wakeup) != 0) {
+        int error = errno;
+
+        rts_timerfd_waiter_close(waiter);
+        errno = error;
+        rb_sys_fail("timerfd waiter");
+    }
+    return self;
+}
+
+static void *rts_timerfd_waiter_wait_nogvl(void *ptr)
+{
+    rts_timerfd_waiter *waiter = ptr;
+    struct epoll_event event;
+    uint64_t count;
+    int ready;
+
+    /* Any readiness ends the wait: the timer expired or we were interrupted. */
+    do {
+        ready = epoll_wait(waiter->epoll, &event, 1, -1);
+    } while (ready < 0 && errno == EINTR);
+    if (ready > 0 && read(event.data.fd, &count, sizeof(count)) < 0) {
+        /* Already consumed; the waiter only cares that the wait ended. */
+    }
+    return NULL;
+}
+
+static void rts_timerfd_waiter_unblock(void *ptr)
+{
+    rts_timerfd_waiter *waiter = ptr;
+    uint64_t one = 1;
+
+    if (write(waiter->wakeup, &one, sizeof(one)) < 0) {
+        /* The counter is saturated, so a wakeup is pending anyway. */
+    }
+}
+
+/*
+ * call-seq: arm(deadline) -> nil
+ *
+ * Sets the timerfd to the deadline (monotonic nanoseconds), or disarms it
+ * when +deadline+ is nil. The kernel reprograms a pending epoll wait itself,
+ * so no wakeup is needed.
+ */
+static VALUE rts_timerfd_waiter_arm(VALUE self, VALUE deadline)
+{
+    rts_timerfd_waiter *waiter;
+    struct itimerspec spec = { { 0, 0 }, { 0, 0 } };
+    int64_t value = rts_deadline_value(deadline);
+
+    TypedData_Get_Struct(self, rts_timerfd_waiter, &rts_timerfd_waiter_type, waiter);
+    if (value != DISARMED) {
+        /* An all-zero it_value would disarm instead. */
+        if (value <= 0) value = 1;
+        spec.it_value.tv_sec = (time_t)(value / NSEC_PER_SEC);
+        spec.it_value.tv_nsec = (long)(value % NSEC_PER_SEC);
+    }
+    if (timerfd_settime(waiter->timer, TFD_TIMER_ABSTIME, &spec, NULL) != 0) {
+        rb_sys_fail("timerfd_settime");
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq: wait -> nil
+ *
+ * Blocks in epoll_wait without the GVL until the timerfd expires. Returns
+ * early when the calling thread is interrupted (Thread#raise, Thread#kill).
+ */
+static VALUE rts_timerfd_waiter_wait(VALUE self)
+{
+    rts_timerfd_waiter *waiter;
+    uint64_t count;
+
+    TypedData_Get_Struct(self, rts_timerfd_waiter, &rts_timerfd_waiter_type, waiter);
+    /* Drop a wakeup left over from an interrupt that arrived outside a wait. */
+    if (read(waiter->wakeup, &count, sizeof(count)) < 0) {
+        /* Nothing pending. */
+    }
+    rb_thread_call_without_gvl(rts_timerfd_waiter_wait_nogvl, waiter, rts_timerfd_waiter_unblock, waiter);
+    return Qnil;
+}
+#endif
+
+/* SignalTimer */
+
+#ifdef RTS_SIGNAL_TIMER
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/*
+ * Real-time signals are not reachable from Signal.trap, so this one cannot
+ * collide with Ruby-level handlers. SIGRTMIN already excludes the signals
+ * glibc reserves for itself.
+ */
+#define RTS_SIGNAL (SIGRTMIN + 3)
+
+typedef struct {
+    timer_t id;
+    pid_t pid; /* process the timer was created in; timers do not survive fork */
+} rts_signal_timer;
+
+/*
+ * Does nothing: the signal exists only to make the blocking system call fail
+ * with EINTR. It is installed without SA_RESTART for the same reason.
+ */
+static void rts_signal_handler(int signo)
+{
+}
+
+static void rts_signal_install(void)
+{
+    struct sigaction action, previous;
+
+    if (sigaction(RTS_SIGNAL, NULL, &previous) != 0) {
+        rb_sys_fail("sigaction");
+    }
+    if (previous.sa_handler == rts_signal_handler) {
+        return;
+    }
+    if (previous.sa_handler != SIG_DFL) {
+        rb_raise(rb_eRuntimeError, "signal %d is already handled by someone else", RTS_SIGNAL);
+    }
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = rts_signal_handler;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(RTS_SIGNAL, &action, NULL) != 0) {
+        rb_sys_fail("sigaction");
+    }
+}
+
+static void rts_signal_timer_delete(rts_signal_timer *timer)
+{
+    if (timer->pid == getpid()) {
+        timer_delete(timer->id);
+    }
+    timer->pid = 0;
+}
+
+static void rts_signal_timer_free(void *ptr)
+{
+    rts_signal_timer *timer = ptr;
+
+    rts_signal_timer_delete(timer);
+    xfree(timer);
+}
+
+static size_t rts_signal_timer_memsize(const void *ptr)
+{
+    return sizeof(rts_signal_timer);
+}
+
+static const rb_data_type_t rts_signal_timer_type = {
+    "RubyTimeoutSafe::Native::SignalTimer",
+    { NULL, rts_signal_timer_free, rts_signal_timer_memsize },
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE rts_signal_timer_alloc(VALUE klass)
+{
+    rts_signal_timer *timer;
+
+    return TypedData_Make_Struct(klass, rts_signal_timer, &rts_signal_timer_type, timer);
+}
+
+/* Creates the kernel timer, aimed at the calling thread. */
+static void rts_signal_timer_create(rts_signal_timer *timer)
+{
+    struct sigevent event;
+
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = RTS_SIGNAL;
+    event.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+    if (timer_create(CLOCK_MONOTONIC, &event, &timer->id) != 0) {
+        rb_sys_fail("timer_create");
+    }
+    timer->pid = getpid();
+}
+
+/*
+ * call-seq: new -> signal_timer
+ *
+ * Creates a POSIX timer that signals the calling native thread. Installs the
+ * (empty) signal handler on first use.
+ */
+static VALUE rts_signal_timer_initialize(VALUE self)
+{
+    rts_signal_timer *timer;
+
+    TypedData_Get_Struct(self, rts_signal_timer, &rts_signal_timer_type, timer);
+    rts_signal_install();
+    rts_signal_timer_create(timer);
+    return self;
+}
+
+static void rts_signal_timer_set(rts_signal_timer *timer, int64_t at, int64_t interval)
+{
+    struct itimerspec spec;
+
+    if (timer->pid != getpid()) {
+        /* Forked: the parent's timer is gone and so is the thread it targeted. */
+        rts_signal_timer_create(timer);
+    }
+    spec.it_value.tv_sec = (time_t)(at / NSEC_PER_SEC);
+    spec.it_value.tv_nsec = (long)(at % NSEC_PER_SEC);
+    spec.it_interval.tv_sec = (time_t)(interval / NSEC_PER_SEC);
+    spec.it_interval.tv_nsec = (long)(interval % NSEC_PER_SEC);
+    if (timer_settime(timer->id, TIMER_ABSTIME, &spec, NULL) != 0) {
+        rb_sys_fail("timer_settime");
+    }
+}
+
+/*
+ * call-seq: arm(at, interval) -> nil
+ *
+ * Signals the thread at +at+ (monotonic nanoseconds), then every +interval+
+ * nanoseconds until #disarm, so a call that restarts after EINTR is hit again.
+ */
+static VALUE rts_signal_timer_arm(VALUE self, VALUE at, VALUE interval)
+{
+    rts_signal_timer *timer;
+    int64_t value = NUM2LL(at);
+
+    TypedData_Get_Struct(self, rts_signal_timer, &rts_signal_timer_type, timer);
+    /* An all-zero it_value would disarm instead. */
+    rts_signal_timer_set(timer, value > 0 ? value : 1, NUM2LL(interval));
+    return Qnil;
+}
+
+/*
+ * call-seq: disarm -> nil
+ *
+ * Stops the timer.
+ */
+static VALUE rts_signal_timer_disarm(VALUE self)
+{
+    rts_signal_timer *timer;
+
+    TypedData_Get_Struct(self, rts_signal_timer, &rts_signal_timer_type, timer);
+    if (timer->pid == getpid()) {
+        rts_signal_timer_set(timer, 0, 0);
+    }
+    return Qnil;
+}
+#endif
+
+void Init_ruby_timeout_safe(void)
+{
+    VALUE mRubyTimeoutSafe = rb_define_module("RubyTimeoutSafe");
+    VALUE mNative = rb_define_module_under(mRubyTimeoutSafe, "Native");
+    VALUE cCondvarWaiter = rb_define_class_under(mNative, "CondvarWaiter", rb_cObject);
+
+#ifdef HAVE_PTHREAD_GETCPUCLOCKID
+    rb_define_module_function(mNative, "thread_cpu_clock_id", rts_thread_cpu_clock_id, 0);
+#endif
+
+    rb_define_alloc_func(cCondvarWaiter, rts_condvar_waiter_alloc);
+    rb_define_method(cCondvarWaiter, "arm", rts_condvar_waiter_arm, 1);
+    rb_define_method(cCondvarWaiter, "wait", rts_condvar_waiter_wait, 0);
+
+#ifdef RTS_TIMERFD_WAITER
+    {
+        VALUE cTimerfdWaiter = rb_define_class_under(mNative, "TimerfdWaiter", rb_cObject);
+
+        rb_define_alloc_func(cTimerfdWaiter, rts_timerfd_waiter_alloc);
+        rb_define_method(cTimerfdWaiter, "initialize", rts_timerfd_waiter_initialize, 0);
+        rb_define_method(cTimerfdWaiter, "arm", rts_timerfd_waiter_arm, 1);
+        rb_define_method(cTimerfdWaiter, "wait", rts_timerfd_waiter_wait, 0);
+    }
+#endif
+#ifdef RTS_SIGNAL_TIMER
+    {
+        VALUE cSignalTimer = rb_define_class_under(mNative, "SignalTimer", rb_cObject);
+
+        rb_define_alloc_func(cSignalTimer, rts_signal_timer_alloc);
+        rb_define_const(cSignalTimer, "SIGNAL", INT2FIX(RTS_SIGNAL));
+        rb_define_method(cSignalTimer, "initialize", rts_signal_timer_initialize, 0);
+        rb_define_method(cSignalTimer, "arm", rts_signal_timer_arm, 2);
+        rb_define_method(cSignalTimer, "disarm", rts_signal_timer_disarm, 0);
+    }
+#endif
+}
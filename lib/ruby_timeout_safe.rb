@@ -2,29 +2,524 @@
 
 require 'timeout'
 require_relative 'ruby_timeout_safe/version'
+require_relative 'ruby_timeout_safe/batch'
+require_relative 'ruby_timeout_safe/clock'
+require_relative 'ruby_timeout_safe/deadline'
+require_relative 'ruby_timeout_safe/event'
+require_relative 'ruby_timeout_safe/histogram'
+require_relative 'ruby_timeout_safe/io_timeout'
+require_relative 'ruby_timeout_safe/isolation'
+require_relative 'ruby_timeout_safe/isolation_error'
+require_relative 'ruby_timeout_safe/map_result'
+require_relative 'ruby_timeout_safe/profiler'
+require_relative 'ruby_timeout_safe/timeout_error'
+require_relative 'ruby_timeout_safe/cancelled_error'
+require_relative 'ruby_timeout_safe/scope'
+require_relative 'ruby_timeout_safe/stats'
+require_relative 'ruby_timeout_safe/thread_pool'
+require_relative 'ruby_timeout_safe/thread_propagation'
+require_relative 'ruby_timeout_safe/timer'
+require_relative 'ruby_timeout_safe/timer_heap'
+require_relative 'ruby_timeout_safe/timing_wheel'
+require_relative 'ruby_timeout_safe/waiter'
+require_relative 'ruby_timeout_safe/watchdog'
+require_relative 'ruby_timeout_safe/worker_pool'
+
+begin
+  require 'ruby_timeout_safe/ruby_timeout_safe'
+rescue LoadError
+  # The native extension is optional; the pure-Ruby engine is used without it.
+end
 
 # A safe timeout implementation for Ruby using monotonic time.
 module RubyTimeoutSafe
-  def self.timeout(seconds = nil)
-    return yield if seconds.nil? || seconds.zero?
+  # Settings accepted by ::configure.
+  #
+  # +engine+:: how the watchdog waits: +:timerfd+ (native, Linux: one timerfd
+  #            polled with epoll), +:condvar+ (native, pthread condition
+  #            variable), +:ruby+, or +:auto+ for the best one available.
+  # +store+:: deadline store, +:heap+ or +:wheel+.
+  # +tick+:: timing wheel resolution in seconds.
+  # +signal+:: also interrupt blocking system calls with a per-thread POSIX
+  #            timer signal (native extension, Linux only).
+  # +signal_interval+:: seconds after the deadline before the first signal,
+  #                     and between repeats until the scope ends.
+  # +io_grace+:: seconds the watchdog waits past the deadline of an
+  #              <tt>io: true</tt> scope, or inside a ::budget block, so that
+  #              IO calls or the client time out first.
+  # +pool_size+:: threads in the shared ThreadPool that ::map runs on.
+  # +cancel_grace+:: seconds a <tt>threads: true</tt> scope waits for its
+  #                  cancelled children before killing them.
+  DEFAULTS = { engine: :auto, store: :heap, tick: 0.001, signal: false, signal_interval: 0.01, io_grace: 0.01,
+               pool_size: 32, cancel_grace: 1 }.freeze
+
+  # Fiber-local key of the ThreadState holding the active scopes.
+  STATE_KEY = :__ruby_timeout_safe__
+  private_constant :STATE_KEY
+
+  class << self
+    # The process-wide Watchdog enforcing every timeout scope.
+    attr_reader :watchdog
+
+    attr_reader :settings
+
+    # The ThreadPool ::map uses unless given another.
+    attr_reader :thread_pool
+
+    # The Profiler recording expiries, if one is installed.
+    attr_reader :profiler
+  end
+
+  # Installs a Profiler, or removes it with nil.
+  def self.profiler=(profiler)
+    @profiler = profiler
+    @watchdog.profiler = profiler
+  end
+
+  # Calls +subscriber+ (or the block) with an Event as each wall-clock scope
+  # starts and ends, in the thread running it. Returns the subscriber.
+  # Exceptions it raises are printed and otherwise ignored. With no
+  # subscribers, scopes only pay for checking that the list is empty.
+  def self.subscribe(subscriber = nil, &block)
+    subscriber ||= block
+    raise ArgumentError, 'a subscriber must respond to #call' unless subscriber.respond_to?(:call)
+
+    @subscription.synchronize { @subscribers = [*@subscribers, subscriber].freeze }
+    subscriber
+  end
+
+  def self.unsubscribe(subscriber)
+    @subscription.synchronize { @subscribers = (@subscribers - [subscriber]).freeze }
+    nil
+  end
+
+  # The innermost active timeout scope of the current thread, if any.
+  def self.current_scope
+    Thread.current[STATE_KEY]&.scope
+  end
+
+  # Whether the deadline binding the current thread's innermost scope has
+  # passed. Reads a flag set by the watchdog, so it is cheap enough to call on
+  # every iteration of a CPU-bound loop.
+  def self.expired?
+    scope = Thread.current[STATE_KEY]&.scope
+    scope ? scope.expiring.expired? : false
+  end
+
+  # Raises TimeoutError if ::expired?. A checkpoint for CPU-bound loops, in
+  # either mode.
+  def self.check!
+    scope = Thread.current[STATE_KEY]&.scope
+    return unless scope&.expiring&.expired?
+
+    expiring = scope.expiring
+    expiring.retain!
+    raise TimeoutError.new('execution expired', expiring)
+  end
+
+  # The Deadline the current thread's innermost scope is bound by, or nil
+  # outside any scope. Repeated calls within a scope return the same object.
+  def self.current_deadline
+    Thread.current[STATE_KEY]&.scope&.effective_deadline
+  end
+
+  # Runs the block with threads it starts left out of <tt>threads: true</tt>
+  # scopes: they neither inherit the deadline nor end with the scope. For
+  # threads meant to outlive it, such as pool workers started on first use.
+  def self.untracked
+    state = Thread.current[STATE_KEY] ||= ThreadState.new
+    state.untracked += 1
+    begin
+      yield
+    ensure
+      state.untracked -= 1
+    end
+  end
+
+  # Seconds left before the deadline binding the current thread, rounded up
+  # to the millisecond, or +default+ when that is sooner or there is no
+  # deadline. A hook for clients that take their own timeouts:
+  #
+  #   RubyTimeoutSafe.budget(5) { |seconds| redis.with(read_timeout: seconds) { ... } }
+  #
+  # Given a block, yields the budget and returns the block's value. While the
+  # block runs, the watchdog holds off until +io_grace+ past the deadline,
+  # so that the client's own timeout fails first.
+  #
+  # Raises TimeoutError, like ::check!, if the deadline has already passed.
+  def self.budget(default = nil)
+    state = Thread.current[STATE_KEY]
+    scope = state&.scope
+    return block_given? ? yield(default) : default unless scope
+
+    expiring = scope.expiring
+    remaining = expiring.deadline - Clock.now
+    unless remaining.positive?
+      expiring.expire!
+      expiring.retain!
+      raise TimeoutError.new('execution expired', expiring)
+    end
+
+    seconds = -(-remaining / Clock::NANOSECONDS_PER_MILLISECOND) / 1000.0
+    seconds = default if default && default < seconds
+    return seconds unless block_given?
+
+    state.deferring { yield seconds }
+  end
+
+  # Whether the native extension is loaded.
+  def self.native?
+    defined?(Native) ? true : false
+  end
+
+  # Changes the given settings and replaces the watchdog. Scopes already
+  # running stay with the previous watchdog until they finish; its thread
+  # ends then. A new
+  # +pool_size+ replaces the thread pool likewise.
+  def self.configure(**options)
+    unknown = options.keys - DEFAULTS.keys
+    raise ArgumentError, "unknown setting: #{unknown.first}" unless unknown.empty?
+
+    settings = (@settings || DEFAULTS).merge(options).freeze
+    raise ArgumentError, 'io_grace must not be negative' if settings[:io_grace].negative?
+    raise ArgumentError, 'cancel_grace must not be negative' if settings[:cancel_grace].negative?
+
+    pool = ThreadPool.new(size: settings[:pool_size]) unless @thread_pool&.size == settings[:pool_size]
+
+    watchdog = Watchdog.new(build_store(settings), waiter_class(settings[:engine]),
+                            signal_interval: signal_interval(settings),
+                            io_grace: (settings[:io_grace] * Clock::NANOSECONDS_PER_SECOND).to_i)
+    watchdog.profiler = @profiler
+    @watchdog&.retire
+    @watchdog = watchdog
+    if pool
+      @thread_pool&.shutdown
+      @thread_pool = pool
+    end
+    @settings = settings
+  end
+
+  # Whether blocking system calls can be interrupted with signals here.
+  def self.signals?
+    defined?(Native::SignalTimer) ? true : false
+  end
+
+  def self.build_store(settings)
+    case settings[:store]
+    when :heap
+      TimerHeap.new
+    when :wheel
+      TimingWheel.new(tick: (settings[:tick] * Clock::NANOSECONDS_PER_SECOND).to_i)
+    else
+      raise ArgumentError, "unknown store: #{settings[:store].inspect}"
+    end
+  end
+  private_class_method :build_store
+
+  # The engines this build supports, best first.
+  def self.engines
+    engines = %i[ruby]
+    engines.unshift(:condvar) if native?
+    engines.unshift(:timerfd) if defined?(Native::TimerfdWaiter)
+    engines
+  end
 
-    raise ArgumentError, 'timeout value must be at least 0.1 second' if seconds < 0.1
+  def self.waiter_class(engine)
+    case engine
+    when :auto
+      waiter_class(engines.first)
+    when :ruby
+      Waiter
+    when :condvar, :timerfd
+      raise ArgumentError, "engine #{engine.inspect} is not available in this build" unless engines.include?(engine)
 
-    current_thread = Thread.current
+      engine == :timerfd ? Native::TimerfdWaiter : Native::CondvarWaiter
+    else
+      raise ArgumentError, "unknown engine: #{engine.inspect}"
+    end
+  end
+  private_class_method :waiter_class
+
+  def self.signal_interval(settings)
+    return unless settings[:signal]
+    raise ArgumentError, 'signal interruption requires the native extension on Linux' unless signals?
+
+    interval = (settings[:signal_interval] * Clock::NANOSECONDS_PER_SECOND).to_i
+    raise ArgumentError, 'signal_interval must be positive' unless interval.positive?
+
+    interval
+  end
+  private_class_method :signal_interval
+
+  # Delivery modes accepted by ::timeout.
+  #
+  # +:raise+:: the watchdog raises TimeoutError in the thread (default).
+  # +:cooperative+:: the watchdog only flags the scope; the block polls with
+  #                  ::check! or ::expired?.
+  # +:on_blocking+:: the watchdog raises, but the error is only delivered
+  #                  once the block blocks (IO, sleep, a lock, a queue) or
+  #                  leaves the scope, never in the middle of Ruby code.
+  MODES = %i[raise cooperative on_blocking].freeze
+
+  # Interrupt masks for Thread.handle_interrupt. Frozen and compared by
+  # identity, so that it takes them as they are instead of copying them.
+  DEFER_TIMEOUT = { Timeout::Error => :never }.compare_by_identity.freeze
+  TIMEOUT_ON_BLOCKING = { Timeout::Error => :on_blocking }.compare_by_identity.freeze
+  private_constant :DEFER_TIMEOUT, :TIMEOUT_ON_BLOCKING
+
+  # Runs the block with timeout errors held back: one that arrives meanwhile
+  # is raised as the block returns, or at the next blocking call of an
+  # enclosing <tt>mode: :on_blocking</tt> scope. For libraries to mark code
+  # that must not be torn halfway, such as checking a connection back into a
+  # pool or an +ensure+ clause that releases a resource:
+  #
+  #   ensure
+  #     RubyTimeoutSafe.critical { pool.checkin(connection) }
+  #
+  # Costs one Thread.handle_interrupt call. ::check! still raises inside, but
+  # IO is not bounded by <tt>io: true</tt> scopes there.
+  def self.critical(&block)
+    state = Thread.current[STATE_KEY] ||= ThreadState.new
+    state.critical += 1
+    state.hold_signals
+    begin
+      Thread.handle_interrupt(DEFER_TIMEOUT, &block)
+    ensure
+      state.release_signals
+      state.critical -= 1
+    end
+  end
+
+  # Calls the block with each of +items+, up to +concurrency+ at a time, and
+  # returns a MapResult of what finished in time:
+  #
+  #   result = RubyTimeoutSafe.map(ids, timeout: 0.5, per_item: 0.2, concurrency: 16) { |id| fetch(id) }
+  #   result.values    # => [..., nil, ...], in the order of +ids+
+  #   result.timed_out # => [1], positions in +ids+
+  #
+  # +timeout+ (seconds, or a Deadline) bounds the whole call, as does an
+  # enclosing deadline: the call returns when it passes, and items still
+  # running or not yet started are reported as timed out. +per_item+ bounds
+  # each call of the block. Errors the block raises are collected in
+  # MapResult#errors rather than raised.
+  #
+  # The block runs on the calling thread and on up to <tt>concurrency - 1</tt>
+  # threads of +pool+, each taking one item after another, in scopes enforced
+  # by the watchdog. Thousands of items need no more threads than that.
+  def self.map(items, timeout: nil, per_item: nil, concurrency: 8, pool: thread_pool, &block)
+    raise ArgumentError, 'a block is required' unless block
+    unless concurrency.is_a?(Integer) && concurrency.positive?
+      raise ArgumentError, 'concurrency must be a positive integer'
+    end
+    raise ArgumentError, 'per_item must not be negative' if per_item&.negative?
+    unless timeout.nil? || timeout.is_a?(Deadline)
+      raise ArgumentError, 'timeout value must not be negative' if timeout.negative?
+
+      timeout = (Deadline.in(timeout) unless timeout.zero?)
+    end
+
+    items = items.to_a
+    deadline = current_deadline&.min(timeout) || timeout
+    batch = Batch.new(items, deadline, (per_item unless per_item&.zero?), block)
+    ([concurrency, items.size].min - 1).times { pool.post { batch.drain } }
+    batch.drain
+    batch.wait
+  ensure
+    batch&.close
+  end
+
+  # Clocks a ::timeout budget can be measured on.
+  #
+  # +:monotonic+:: elapsed wall time (default).
+  # +:thread_cpu+:: CPU time consumed by the calling thread.
+  CLOCKS = %i[monotonic thread_cpu].freeze
+
+  # Runs the block and raises TimeoutError (a Timeout::Error) in the calling
+  # thread if it is still running after +seconds+, which may also be a
+  # Deadline. Nested calls share one armed deadline per thread: the earliest.
+  #
+  # In a non-blocking fiber the deadline is handed to the fiber scheduler's
+  # +timeout_after+ instead, which cancels only that fiber. It raises where
+  # the fiber is suspended, so at a blocking point in either delivering mode.
+  #
+  # With <tt>isolate: :process</tt> the block runs in a forked child whose
+  # process group is SIGKILLed at the deadline; see Isolation. Its value or
+  # error must survive Marshal.
+  #
+  # A +soft+ deadline (seconds, usually shorter than +seconds+) runs
+  # <tt>on_soft.call(scope, thread)</tt> on the watchdog thread when it passes,
+  # while the block keeps running; the hard deadline still raises. It shares
+  # the thread's single watchdog entry. Keep the callback cheap: count a
+  # metric, or take <tt>thread.backtrace_locations</tt> to see where the
+  # block is. A fiber scheduler enforcing the scope ignores it.
+  #
+  # With <tt>clock: :thread_cpu</tt> +seconds+ is a budget of CPU time used by
+  # the calling thread, so time spent descheduled or blocked does not count.
+  # Such a scope stands apart from the others: it is not part of
+  # ::current_scope or ::current_deadline, and it can only raise and cannot
+  # be isolated.
+  #
+  # With <tt>io: true</tt>, blocking IO calls in the block and in scopes
+  # nested in it time out waiting for the IO at the deadline, and the
+  # watchdog only raises +io_grace+ later if the block is still running; see
+  # IOTimeout. Cooperative scopes and critical sections are left alone.
+  #
+  # With <tt>threads: true</tt>, threads started in the block (Thread.new,
+  # ::start, ::fork), and in scopes nested in it, run bound by the deadline of
+  # the scope they were started in. Those still running when the scope ends
+  # get a CancelledError, and the scope waits for them to unwind. With no
+  # +seconds+ the scope has no deadline but still owns its threads. See
+  # ThreadPropagation, and ::untracked for threads meant to outlive the scope.
+  #
+  # Wall-clock scopes publish Events to ::subscribe'd callables.
+  def self.timeout(seconds = nil, mode: :raise, isolate: nil, clock: :monotonic, soft: nil, on_soft: nil, io: false,
+                   threads: false)
+    raise ArgumentError, "unknown mode: #{mode.inspect}" unless MODES.include?(mode)
+    raise ArgumentError, "unknown isolation: #{isolate.inspect}" unless isolate.nil? || isolate == :process
+    raise ArgumentError, 'an isolated block cannot be cooperative' if isolate && mode == :cooperative
+    raise ArgumentError, "unknown clock: #{clock.inspect}" unless CLOCKS.include?(clock)
+    if soft
+      raise ArgumentError, 'soft: needs an on_soft: callback' unless on_soft
+      raise ArgumentError, 'soft: only applies to in-process wall-clock scopes' if isolate || clock != :monotonic
+    end
+    if io
+      raise ArgumentError, 'io: needs IO#wait_readable, IO#timeout and Integer#ceildiv (Ruby 3.2+)' unless IOTimeout.supported?
+      raise ArgumentError, 'io: only applies to in-process wall-clock scopes' if isolate || clock != :monotonic
+
+      IOTimeout.install
+    end
+    if threads
+      raise ArgumentError, 'threads: only applies to in-process wall-clock scopes' if isolate || clock != :monotonic
+
+      ThreadPropagation.install
+    end
+    return cpu_timeout(seconds, mode, isolate) { yield } if clock == :thread_cpu
 
-    start_time = Process.clock_gettime(Process::CLOCK_MONOTONIC)
-    s_thread = Thread.new do
-      loop do
-        elapsed_time = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start_time
-        break if elapsed_time >= seconds
+    if seconds.is_a?(Deadline)
+      deadline = seconds.at
+      seconds = seconds.remaining
+    else
+      if seconds.nil? || seconds.zero?
+        return yield unless threads
 
-        sleep(0.05) # Sleep briefly to prevent busy-waiting
+        # Still a scope, with no deadline, so that it owns its threads.
+        seconds = Float::INFINITY
       end
-      current_thread.raise Timeout::Error, 'execution expired'
+
+      raise ArgumentError, 'timeout value must not be negative' if seconds.negative?
+
+      deadline = Clock.deadline_in(seconds)
+    end
+
+    state = Thread.current[STATE_KEY] ||= ThreadState.new
+    scheduler = fiber_scheduler unless mode == :cooperative || isolate
+    # An isolated parent only waits on a pipe, and a fiber scheduler enforces
+    # its own deadlines: neither needs the watchdog. The stack and the timer
+    # change together, with timeouts held back, and +scope+ is set before
+    # they are let through, so that the ensure clause always sees it.
+    scope = nil
+    Thread.handle_interrupt(DEFER_TIMEOUT) do
+      scope = if isolate || scheduler
+                state.enter(seconds, deadline, mode, nil)
+              else
+                state.enter(seconds, deadline, mode, watchdog, soft && Clock.deadline_in(soft), on_soft, io)
+              end
+    end
+    scope.site = caller_locations(1, 1).first if @profiler && !(isolate || scheduler)
+    scope.own_threads! if threads
+    subscribers = @subscribers
+    started = publish_start(subscribers, scope) unless subscribers.empty?
+
+    if isolate
+      Isolation.call(scope) { yield }
+    elsif scheduler
+      scope.retain!
+      # Kernel#raise turns the instance into a copy carrying the scope.
+      scheduler.timeout_after(seconds, TimeoutError.new('execution expired', scope), 'execution expired') { yield }
+    elsif mode == :on_blocking
+      state.hold_signals
+      begin
+        Thread.handle_interrupt(TIMEOUT_ON_BLOCKING) { yield }
+      ensure
+        state.release_signals
+      end
+    else
+      yield
+    end
+  ensure
+    begin
+      publish_finish(subscribers, scope, started, $!) if started
+      ThreadPropagation.reap(scope) if scope&.children
+    ensure
+      # A TimeoutError arriving halfway through would leave the enclosing
+      # deadline unarmed; it is raised once the stack is consistent again.
+      Thread.handle_interrupt(DEFER_TIMEOUT) { state.leave(scope) if scope }
+    end
+  end
+
+  # Publishes :start, and :nested_skip if an enclosing deadline is earlier.
+  # Returns the start time.
+  def self.publish_start(subscribers, scope)
+    started = Clock.now
+    publish(subscribers, Event.new(:start, scope))
+    publish(subscribers, Event.new(:nested_skip, scope)) unless scope.expiring.equal?(scope)
+    started
+  end
+  private_class_method :publish_start
+
+  # Publishes :expire if the scope's own deadline passed, which +error+ tells
+  # when a fiber scheduler raised it, else :complete.
+  def self.publish_finish(subscribers, scope, started, error)
+    now = Clock.now
+    if scope.expired? || (error.is_a?(TimeoutError) && error.scope.equal?(scope))
+      publish(subscribers, Event.new(:expire, scope, now - started, now - scope.deadline))
+    else
+      publish(subscribers, Event.new(:complete, scope, now - started))
+    end
+  end
+  private_class_method :publish_finish
+
+  def self.publish(subscribers, event)
+    subscribers.each do |subscriber|
+      subscriber.call(event)
+    rescue StandardError => e
+      warn("ruby_timeout_safe: subscriber failed on #{event.type}: #{e.class}: #{e.message}")
     end
+  end
+  private_class_method :publish
 
+  def self.cpu_timeout(seconds, mode, isolate)
+    raise ArgumentError, 'a CPU-time budget must be a number of seconds' if seconds.is_a?(Deadline)
+    raise ArgumentError, 'a CPU-time budget can only raise' unless mode == :raise && isolate.nil?
+    return yield if seconds.nil? || seconds.zero?
+    raise ArgumentError, 'timeout value must not be negative' if seconds.negative?
+
+    budget = Clock.nanoseconds_in(seconds)
+    return yield if budget == Clock::FOREVER
+
+    clock = Clock.thread_cpu_id
+    cpu_deadline = Clock.cpu_now(clock) + budget
+    # Kept even if ::configure replaces the watchdog meanwhile.
+    enforcer = watchdog
+    scope = Scope.new(nil, seconds, cpu_deadline)
+    scope.site = caller_locations(2, 1).first if @profiler
+    timer = nil
+    Thread.handle_interrupt(DEFER_TIMEOUT) { timer = enforcer.register_cpu(Thread.current, clock, cpu_deadline, scope) }
     yield
   ensure
-    s_thread.kill if s_thread&.alive?
+    Thread.handle_interrupt(DEFER_TIMEOUT) { enforcer.cancel(timer) if timer }
   end
+  private_class_method :cpu_timeout
+
+  # The scheduler of the current fiber if it is non-blocking and supports
+  # +timeout_after+.
+  def self.fiber_scheduler
+    scheduler = Fiber.respond_to?(:current_scheduler) ? Fiber.current_scheduler : (Fiber.scheduler unless Fiber.current.blocking?)
+    scheduler if scheduler.respond_to?(:timeout_after)
+  end
+  private_class_method :fiber_scheduler
+
+  @subscribers = [].freeze
+  @subscription = Thread::Mutex.new
+  configure
 end
@@ -0,0 +1,111 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # One ::map call, shared by the calling thread and the pool threads working
+  # on it. Each of them takes the next item under the lock and runs the block
+  # in a scope of its own, until no items are left or the deadline passes. So
+  # a batch uses as many threads as it was given, however many items it has.
+  class Batch
+    # +deadline+ (a Deadline or nil) bounds the whole batch, +per_item+
+    # (seconds or nil) each call of +block+.
+    def initialize(items, deadline, per_item, block)
+      @items = items
+      @deadline = deadline
+      @per_item = per_item
+      @block = block
+      @mutex = Thread::Mutex.new
+      @finished = Thread::ConditionVariable.new
+      @next = 0
+      @pending = items.size
+      # Per item: :value, :timed_out or :error once finished, and the value or
+      # error.
+      @outcomes = Array.new(items.size)
+      @results = Array.new(items.size)
+      @closed = false
+    end
+
+    # Runs items until none are left, the deadline has passed or the batch is
+    # closed.
+    def drain
+      while (index = claim)
+        begin
+          outcome, result = run(@items[index])
+        rescue Exception => e # not the block's to report; the item still ends
+          finish(index, :error, e)
+          raise
+        end
+        finish(index, outcome, result)
+      end
+    end
+
+    # Waits until every item has finished, or the deadline passes, and closes
+    # the batch. Items still running then are reported as timed out; they are
+    # being interrupted at the same deadline.
+    def wait
+      @mutex.synchronize do
+        until @pending.zero? || @deadline&.expired?
+          @finished.wait(@mutex, @deadline&.remaining)
+        end
+        @closed = true
+      end
+      result
+    end
+
+    def close
+      @mutex.synchronize { @closed = true }
+    end
+
+    private
+      def claim
+        @mutex.synchronize do
+          next if @closed || @next == @items.size || @deadline&.expired?
+
+          @next += 1
+          @next - 1
+        end
+      end
+
+      def run(item)
+        outer = RubyTimeoutSafe.current_scope
+        deadline = @per_item ? Deadline.in(@per_item).min(@deadline) : @deadline
+        [:value, RubyTimeoutSafe.timeout(deadline) { @block.call(item) }]
+      rescue TimeoutError => e
+        # The calling thread's own scopes expiring is not the item's doing.
+        raise if enclosing?(outer, e.scope)
+
+        [:timed_out, nil]
+      rescue StandardError => e
+        [:error, e]
+      end
+
+      def enclosing?(scope, expired)
+        scope = scope.parent until scope.nil? || scope.equal?(expired)
+        !scope.nil?
+      end
+
+      def finish(index, outcome, result)
+        @mutex.synchronize do
+          next if @closed
+
+          @outcomes[index] = outcome
+          @results[index] = result
+          @pending -= 1
+          @finished.signal if @pending.zero?
+        end
+      end
+
+      def result
+        values = Array.new(@items.size)
+        timed_out = []
+        errors = {}
+        @outcomes.each_with_index do |outcome, index|
+          case outcome
+          when :value then values[index] = @results[index]
+          when :error then errors[index] = @results[index]
+          else timed_out << index
+          end
+        end
+        MapResult.new(values, timed_out, errors)
+      end
+  end
+end
@@ -0,0 +1,10 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # Raised in a thread started inside a <tt>threads: true</tt> scope that is
+  # still running when the scope ends. +scope+ is that scope. The thread's
+  # block is unwound, and the error is then dropped. As a TimeoutError it is
+  # held back by RubyTimeoutSafe.critical and <tt>mode: :on_blocking</tt>.
+  class CancelledError < TimeoutError
+  end
+end
@@ -0,0 +1,54 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # Monotonic time as integer nanoseconds. Integers in this range are fixnums,
+  # so reading and comparing deadlines never allocates.
+  module Clock
+    NANOSECONDS_PER_SECOND = 1_000_000_000
+    NANOSECONDS_PER_MILLISECOND = 1_000_000
+
+    # Deadlines are clamped here (~146 years) to stay within fixnum range.
+    FOREVER = (2**62) - 1
+
+    def self.now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+    end
+
+    # Converts a relative duration in seconds to an absolute deadline. An
+    # infinite duration never ends: FOREVER.
+    def self.deadline_in(seconds)
+      deadline = now + nanoseconds_in(seconds)
+      deadline > FOREVER ? FOREVER : deadline
+    end
+
+    # Converts a duration in seconds to nanoseconds, FOREVER if infinite.
+    # Raises ArgumentError for NaN.
+    def self.nanoseconds_in(seconds)
+      unless seconds.finite?
+        raise ArgumentError, 'timeout value must be a number, not NaN' if seconds.nan?
+
+        return FOREVER
+      end
+
+      (seconds * NANOSECONDS_PER_SECOND).to_i
+    end
+
+    # The clock id of the calling thread's CPU-time clock, readable from any
+    # thread with Process.clock_gettime. Uses pthread_getcpuclockid in the
+    # native extension, or the Linux encoding of a per-thread CPU clock.
+    def self.thread_cpu_id
+      return Native.thread_cpu_clock_id if defined?(Native) && Native.respond_to?(:thread_cpu_clock_id)
+      unless RUBY_PLATFORM.include?('linux') && Thread.current.respond_to?(:native_thread_id)
+        raise NotImplementedError, 'thread CPU clocks need the native extension or Linux'
+      end
+
+      # CPUCLOCK_PERTHREAD_MASK | CPUCLOCK_SCHED, for the thread's kernel tid.
+      ((~Thread.current.native_thread_id) << 3) | 6
+    end
+
+    # Current reading of a clock from ::thread_cpu_id, in nanoseconds.
+    def self.cpu_now(clock)
+      Process.clock_gettime(clock, :nanosecond)
+    end
+  end
+end
@@ -0,0 +1,65 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # A point on the monotonic clock, stored as integer nanoseconds. Deadlines
+  # are immutable, and reading #remaining or #expired? allocates nothing, so
+  # they are cheap enough for hot loops.
+  #
+  #   deadline = RubyTimeoutSafe::Deadline.in(0.25)
+  #   socket.read_timeout = deadline.remaining
+  class Deadline
+    include Comparable
+
+    # Monotonic nanoseconds.
+    attr_reader :at
+
+    def self.in(seconds)
+      new(Clock.deadline_in(seconds))
+    end
+
+    def self.at(nanoseconds)
+      new(nanoseconds)
+    end
+
+    def initialize(at)
+      @at = at
+      freeze
+    end
+
+    # Nanoseconds left, or 0 once expired.
+    def remaining_ns
+      remaining = @at - Clock.now
+      remaining.positive? ? remaining : 0
+    end
+
+    # Seconds left as a Float, or 0.0 once expired.
+    def remaining
+      remaining_ns.fdiv(Clock::NANOSECONDS_PER_SECOND)
+    end
+
+    def expired?
+      Clock.now >= @at
+    end
+
+    # The earlier of this deadline and +other+ (which may be nil).
+    def min(other)
+      other.nil? || @at <= other.at ? self : other
+    end
+
+    def <=>(other)
+      @at <=> other.at if other.is_a?(Deadline)
+    end
+
+    def eql?(other)
+      other.is_a?(Deadline) && @at == other.at
+    end
+
+    def hash
+      @at.hash
+    end
+
+    def inspect
+      "#<#{self.class.name} remaining=#{format('%.6f', remaining)}s>"
+    end
+  end
+end
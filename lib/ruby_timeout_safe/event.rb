@@ -0,0 +1,36 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # What RubyTimeoutSafe.subscribe'd callables receive, in the thread running
+  # the scope, for each wall-clock scope:
+  #
+  # +:start+:: the scope was entered.
+  # +:nested_skip+:: follows +:start+ when an enclosing deadline is earlier,
+  #                  so the scope armed nothing.
+  # +:complete+:: the block ended, with a value or an error, before its own
+  #               deadline passed. +elapsed+ and #budget_used are set.
+  # +:expire+:: the scope's own deadline passed. +overshoot+ is how long after
+  #             it the block actually stopped.
+  #
+  # Durations are nanoseconds. +scope+ is only valid during the callback:
+  # finished scopes are recycled.
+  class Event
+    TYPES = %i[start nested_skip complete expire].freeze
+
+    attr_reader :type, :scope, :budget, :elapsed, :overshoot
+
+    def initialize(type, scope, elapsed = 0, overshoot = nil)
+      @type = type
+      @scope = scope
+      @budget = scope.budget
+      @elapsed = elapsed
+      @overshoot = overshoot
+    end
+
+    # Fraction of the budget the block took, 1.0 when it used all of it; nil
+    # for a scope given no time at all (a Deadline already past).
+    def budget_used
+      @elapsed.fdiv(@budget * Clock::NANOSECONDS_PER_SECOND) if @budget.positive?
+    end
+  end
+end
@@ -0,0 +1,83 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # HDR-style histogram of non-negative integers (typically nanoseconds).
+  # Every power of two is split into linear sub-buckets, so any recorded value
+  # is reported within 1/HALF (~1.6%) of itself while memory stays fixed.
+  class Histogram
+    SUB_BITS = 7
+    HALF = 1 << (SUB_BITS - 1)
+    # Enough buckets for any fixnum.
+    BUCKETS = (64 - SUB_BITS + 1) * HALF
+
+    attr_reader :count, :min, :max, :total
+
+    def initialize
+      @counts = Array.new(BUCKETS, 0)
+      reset
+    end
+
+    def record(value)
+      value = 0 if value.negative?
+      @counts[index(value)] += 1
+      @count += 1
+      @total += value
+      @min = value if @min.nil? || value < @min
+      @max = value if @max.nil? || value > @max
+      value
+    end
+
+    def mean
+      @count.zero? ? 0.0 : @total.fdiv(@count)
+    end
+
+    # Smallest value that at least +percent+ of the recordings are below or
+    # equal to, reported as the top of its bucket.
+    def percentile(percent)
+      return if @count.zero?
+
+      rank = (percent.fdiv(100) * @count).ceil.clamp(1, @count)
+      seen = 0
+      @counts.each_with_index do |count, index|
+        seen += count
+        return [highest_value(index), @max].min if seen >= rank
+      end
+    end
+
+    def merge(other)
+      other.each_bucket { |index, count| @counts[index] += count }
+      @count += other.count
+      @total += other.total
+      @min = other.min if other.min && (@min.nil? || other.min < @min)
+      @max = other.max if other.max && (@max.nil? || other.max > @max)
+      self
+    end
+
+    def reset
+      @counts.fill(0)
+      @count = 0
+      @total = 0
+      @min = nil
+      @max = nil
+      self
+    end
+
+    def each_bucket
+      @counts.each_with_index { |count, index| yield index, count unless count.zero? }
+    end
+
+    private
+      def index(value)
+        shift = value.bit_length - SUB_BITS
+        shift = 0 if shift.negative?
+        (shift * HALF) + (value >> shift)
+      end
+
+      def highest_value(index)
+        return index if index < (HALF << 1)
+
+        shift = (index / HALF) - 1
+        ((index - (shift * HALF) + 1) << shift) - 1
+      end
+  end
+end
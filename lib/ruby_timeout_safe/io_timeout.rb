@@ -0,0 +1,89 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # Bounds blocking IO calls made in <tt>io: true</tt> scopes by the deadline,
+  # so that they fail in the IO layer instead of being interrupted by the
+  # watchdog. Each call first waits for the IO to become ready for at most the
+  # time left; a wait that comes back empty is raised as the scope's
+  # TimeoutError. The IO itself is not changed, as other threads may be using
+  # it, and an IO#timeout of its own that is shorter is left to do its job.
+  #
+  # Prepended to IO the first time an IO scope starts. Outside such scopes
+  # each wrapped call costs a thread-local read. A call that blocks again once
+  # the IO was ready (a partial line, a long read, a full pipe), and calls not
+  # wrapped here (IO#readpartial, IO#sysread, or the nonblocking calls that
+  # libraries pair with an explicit wait) are still covered by the watchdog,
+  # +io_grace+ after the deadline.
+  module IOTimeout
+    # Blocking calls, by what they wait for.
+    READS = %i[read gets getc getbyte readchar readbyte readline readlines].freeze
+    WRITES = %i[write print puts <<].freeze
+
+    { wait_readable: READS, wait_writable: WRITES }.each do |wait, names|
+      names.each do |name|
+        module_eval(<<~RUBY, __FILE__, __LINE__ + 1)
+          def #{name}(...)
+            scope = Thread.current[STATE_KEY]&.io_scope
+            scope ? IOTimeout.bound(self, scope, :#{wait}) { super } : super
+          end
+        RUBY
+      end
+    end
+
+    # Without a timeout of their own these wait for what is left of the
+    # deadline.
+    def wait_readable(timeout = nil)
+      scope = Thread.current[STATE_KEY]&.io_scope if timeout.nil?
+      scope ? IOTimeout.wait(scope) { |seconds| super(seconds) } : super
+    end
+
+    def wait_writable(timeout = nil)
+      scope = Thread.current[STATE_KEY]&.io_scope if timeout.nil?
+      scope ? IOTimeout.wait(scope) { |seconds| super(seconds) } : super
+    end
+
+    # Whether this Ruby has what the wrappers use: IO#wait_readable and
+    # IO#wait_writable in core, IO#timeout and Integer#ceildiv (Ruby 3.2+).
+    def self.supported?
+      IO.method_defined?(:wait_readable) && IO.method_defined?(:timeout) && Integer.method_defined?(:ceildiv)
+    end
+
+    def self.install
+      IO.prepend(self) unless IO <= self
+    end
+
+    # Runs the IO call in the block once +io+ is ready, calling its +wait+
+    # method (IO#wait_readable or IO#wait_writable) with what is left of the
+    # deadline binding +scope+.
+    def self.bound(io, scope, wait)
+      timeout = io.timeout
+      return yield if timeout && timeout <= remaining(scope.expiring)
+
+      wait(scope) { |seconds| io.__send__(wait, seconds) }
+      yield
+    end
+
+    # Yields what is left of the deadline binding +scope+, in seconds, to a
+    # wait; raises the scope's TimeoutError if it comes back empty.
+    def self.wait(scope)
+      expiring = scope.expiring
+      yield(remaining(expiring)) || expired(expiring)
+    end
+
+    def self.remaining(scope)
+      remaining = scope.deadline - Clock.now
+      expired(scope) unless remaining.positive?
+
+      # Rounded up: waits may round down to whole milliseconds.
+      remaining.ceildiv(Clock::NANOSECONDS_PER_MILLISECOND).fdiv(1000)
+    end
+    private_class_method :remaining
+
+    def self.expired(scope)
+      scope.expire!
+      scope.retain!
+      raise TimeoutError.new('execution expired', scope)
+    end
+    private_class_method :expired
+  end
+end
@@ -0,0 +1,111 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # Runs a block in a forked child for timeout(..., isolate: :process), for
+  # work that cannot be interrupted in-thread at all (C extensions that never
+  # return to Ruby, runaway regular expressions).
+  #
+  # The child leads its own process group and writes the marshalled result or
+  # error to a pipe. The parent waits on the pipe until the scope's deadline,
+  # then SIGKILLs the whole group and raises TimeoutError.
+  module Isolation
+    READ_SIZE = 64 * 1024
+
+    # Runs the block in a child bound by +scope+'s effective deadline and
+    # returns its value or raises its error.
+    def self.call(scope, &block)
+      raise NotImplementedError, 'isolate: :process needs Process.fork' unless Process.respond_to?(:fork)
+
+      reader, writer = IO.pipe
+      pid = fork { child(reader, writer, &block) }
+      writer.close
+      # Also done in the child; whichever runs first wins the race with kill.
+      begin
+        Process.setpgid(pid, pid)
+      rescue Errno::EACCES, Errno::ESRCH
+        nil
+      end
+      payload = read(reader, scope.expiring.deadline)
+      unless payload
+        kill(pid)
+        pid = nil
+        expiring = scope.expiring
+        expiring.expire!
+        expiring.retain!
+        raise TimeoutError.new('execution expired', expiring)
+      end
+      _, status = Process.wait2(pid)
+      pid = nil
+      result(payload, status)
+    ensure
+      reader&.close
+      writer.close if writer && !writer.closed?
+      kill(pid) if pid
+    end
+
+    # The whole pipe contents, or nil if +deadline+ passed first.
+    def self.read(reader, deadline)
+      buffer = +''
+      loop do
+        remaining = deadline - Clock.now
+        return if remaining <= 0
+        return unless reader.wait_readable(remaining.fdiv(Clock::NANOSECONDS_PER_SECOND))
+
+        chunk = reader.read_nonblock(READ_SIZE, exception: false)
+        return buffer if chunk.nil?
+
+        buffer << chunk if chunk.is_a?(String)
+      end
+    end
+    private_class_method :read
+
+    def self.result(payload, status)
+      raise IsolationError, "isolated child exited without a result (#{status})" if payload.empty?
+
+      kind, value = Marshal.load(payload)
+      raise value if kind == :error
+
+      value
+    end
+    private_class_method :result
+
+    # Serialized [:ok, value] or [:error, exception], as sent back by children
+    # and WorkerPool workers. Values or errors that do not marshal come back as
+    # IsolationError.
+    def self.dump(kind, value)
+      Marshal.dump([kind, value])
+    rescue TypeError => e
+      error = IsolationError.new("cannot return #{value.class} from an isolated block: #{e.message}")
+      error.set_backtrace(value.backtrace) if value.is_a?(Exception) && value.backtrace
+      Marshal.dump([:error, error])
+    end
+
+    def self.child(reader, writer)
+      reader.close
+      Process.setpgid(0, 0)
+      payload = begin
+        dump(:ok, yield)
+      rescue Exception => e # everything, the parent re-raises it
+        dump(:error, e)
+      end
+      writer.write(payload)
+      writer.close
+      # Skip at_exit handlers and finalizers inherited from the parent.
+      exit!(0)
+    end
+    private_class_method :child
+
+    def self.kill(pid)
+      begin
+        Process.kill(:KILL, -pid)
+      rescue Errno::ESRCH, Errno::EPERM
+        # The group is gone, or the child had not reached setpgid yet.
+        Process.kill(:KILL, pid)
+      end
+      Process.wait(pid)
+    rescue Errno::ESRCH, Errno::ECHILD
+      nil
+    end
+    private_class_method :kill
+  end
+end
@@ -0,0 +1,8 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # Raised when a process-isolated block could not report back: the child died
+  # without a result, or its result or error could not be marshalled.
+  class IsolationError < StandardError
+  end
+end
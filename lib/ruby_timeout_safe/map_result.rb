@@ -0,0 +1,29 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # What ::map returns. Everything is by position in the items, so equal
+  # items are kept apart.
+  class MapResult
+    # The block's value for each item, in order; nil for items that timed out
+    # or raised.
+    attr_reader :values
+
+    # Positions of the items that ran out of time, or were not started before
+    # the overall deadline, ascending.
+    attr_reader :timed_out
+
+    # Position => the StandardError the block raised for that item.
+    attr_reader :errors
+
+    def initialize(values, timed_out, errors)
+      @values = values
+      @timed_out = timed_out
+      @errors = errors
+    end
+
+    # Whether every item finished in time without an error.
+    def complete?
+      @timed_out.empty? && @errors.empty?
+    end
+  end
+end
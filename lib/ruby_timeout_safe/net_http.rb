@@ -0,0 +1,74 @@
+# frozen_string_literal: true
+
+require 'net/http'
+require_relative '../ruby_timeout_safe'
+
+module RubyTimeoutSafe
+  # Opt-in adapter sizing Net::HTTP timeouts to the deadline:
+  #
+  #   require 'ruby_timeout_safe/net_http'
+  #
+  # Inside a timeout scope, each connect runs with +open_timeout+, and each
+  # request with +read_timeout+ and +write_timeout+, lowered to
+  # RubyTimeoutSafe.budget. A request that runs out of time therefore fails in
+  # the socket layer, which closes the connection, before the watchdog, which
+  # holds off until +io_grace+ past the deadline meanwhile.
+  #
+  # When a lowered timeout is what ran out, the Net::OpenTimeout,
+  # Net::ReadTimeout or Net::WriteTimeout is raised as the scope's
+  # TimeoutError. The connection's own settings are restored afterwards.
+  #
+  # Each read or write wait gets the time left when the request started, so
+  # a response trickling in slowly can still outlast the deadline; the
+  # watchdog covers that.
+  module NetHTTP
+    # Timeout setting => the error Net::HTTP raises when it runs out.
+    ERRORS = {
+      open_timeout: Net::OpenTimeout,
+      read_timeout: Net::ReadTimeout,
+      write_timeout: Net::WriteTimeout
+    }.freeze
+
+    def request(req, body = nil, &block)
+      NetHTTP.bound(self, :read_timeout, :write_timeout) { super }
+    end
+
+    # Runs the block with the given timeout settings of +http+ lowered to what
+    # is left of the current deadline.
+    def self.bound(http, *settings)
+      return yield unless RubyTimeoutSafe.current_scope
+
+      RubyTimeoutSafe.budget do |budget|
+        saved = settings.to_h { |setting| [setting, http.public_send(setting)] }
+        lowered = saved.filter_map do |setting, seconds|
+          next if seconds && seconds <= budget
+
+          http.public_send(:"#{setting}=", budget)
+          ERRORS[setting]
+        end
+        begin
+          yield
+        rescue *lowered
+          expired
+        ensure
+          saved.each { |setting, seconds| http.public_send(:"#{setting}=", seconds) }
+        end
+      end
+    end
+
+    def self.expired
+      scope = RubyTimeoutSafe.current_scope.expiring
+      scope.expire!
+      scope.retain!
+      raise TimeoutError.new('execution expired', scope)
+    end
+    private_class_method :expired
+
+    private
+      def connect
+        NetHTTP.bound(self, :open_timeout) { super }
+      end
+  end
+end
+
+Net::HTTP.prepend(RubyTimeoutSafe::NetHTTP)
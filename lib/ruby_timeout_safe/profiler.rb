@@ -0,0 +1,92 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # Where timed-out blocks were when their deadline passed, aggregated per
+  # call site of RubyTimeoutSafe.timeout: a sampling profiler of exactly the
+  # paths that are too slow.
+  #
+  #   RubyTimeoutSafe.profiler = RubyTimeoutSafe::Profiler.new
+  #   ...
+  #   puts RubyTimeoutSafe.profiler.report
+  #
+  # The watchdog takes the thread's backtrace at expiry, before raising, so it
+  # shows the slow code rather than the ensure blocks that run afterwards.
+  # Call sites are only recorded while a profiler is installed.
+  class Profiler
+    UNKNOWN_SITE = '(unknown)'
+
+    # Expiries at one call site, and how often each stack was seen there.
+    class Site
+      attr_reader :count, :stacks
+
+      def initialize
+        @count = 0
+        @stacks = Hash.new(0)
+      end
+
+      def add(stack)
+        @count += 1
+        @stacks[stack] += 1
+      end
+
+      # The +limit+ most frequent stacks with their counts, most frequent first.
+      def top(limit)
+        @stacks.max_by(limit, &:last)
+      end
+    end
+
+    # Frames kept per backtrace.
+    attr_reader :depth
+
+    def initialize(depth: 32)
+      raise ArgumentError, 'depth must be positive' unless depth.positive?
+
+      @depth = depth
+      @mutex = Thread::Mutex.new
+      @sites = {}
+    end
+
+    # Records the expiry of +scope+ in +thread+. Called by the watchdog.
+    def record(scope, thread)
+      locations = thread.backtrace_locations(0, @depth)
+      return unless locations
+
+      site = scope&.site ? "#{scope.site.path}:#{scope.site.lineno}" : UNKNOWN_SITE
+      stack = locations.map(&:to_s).freeze
+      @mutex.synchronize { (@sites[site] ||= Site.new).add(stack) }
+    end
+
+    # Number of expiries recorded.
+    def count
+      @mutex.synchronize { @sites.each_value.sum(&:count) }
+    end
+
+    # Call site => { count:, stacks: [[frames, count], ...] }, busiest sites
+    # first, keeping the +top+ stacks of each.
+    def to_h(top: 5)
+      @mutex.synchronize do
+        @sites.sort_by { |_, site| -site.count }.to_h do |name, site|
+          [name, { count: site.count, stacks: site.top(top) }]
+        end
+      end
+    end
+
+    # A plain-text dump of #to_h.
+    def report(top: 3)
+      lines = []
+      to_h(top: top).each do |name, site|
+        lines << "#{site[:count]} expired at #{name}"
+        site[:stacks].each do |frames, count|
+          lines << "  #{count}x"
+          frames.each { |frame| lines << "    #{frame}" }
+        end
+      end
+      lines.join("\n")
+    end
+
+    def reset
+      @mutex.synchronize { @sites.clear }
+      self
+    end
+  end
+end
@@ -0,0 +1,271 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # One active RubyTimeoutSafe.timeout call. Scopes of a thread form a stack
+  # through +parent+. Only the scope with the earliest deadline on the stack,
+  # +expiring+, has a deadline armed in the watchdog; a nested scope that ends
+  # later than an enclosing one registers nothing. When +expiring+ is
+  # cooperative, +raising+ is the scope with the earliest deadline that
+  # raises, which the timer goes on to once +expiring+ has been flagged.
+  #
+  # A scope may also carry a soft deadline with an +on_soft+ callback.
+  # +soft_owner+ is, likewise, the scope with the earliest soft deadline that
+  # has not fired yet; the armed timer goes off at that first, if it is earlier
+  # than the hard deadline, and is then re-keyed to the hard deadline.
+  #
+  # A scope started with <tt>io: true</tt>, and every scope nested in it, bounds
+  # blocking IO calls by its deadline; see IOTimeout. Threads started in a
+  # <tt>threads: true</tt> scope, or in scopes nested in it, are +children+ of
+  # that +thread_owner+; see ThreadPropagation.
+  #
+  # Scopes are recycled once they finish, unless a TimeoutError refers to them.
+  class Scope
+    attr_reader :parent, :budget, :deadline, :mode, :depth, :expiring, :raising, :soft, :on_soft, :soft_owner
+
+    # Where RubyTimeoutSafe.timeout was called, while a Profiler is installed.
+    attr_accessor :site
+
+    # The scope owning threads started in this one, if any, and the threads
+    # this one owns.
+    attr_reader :thread_owner, :children
+
+    def initialize(parent, budget, deadline, mode = :raise, soft = nil, on_soft = nil, io = false)
+      reset(parent, budget, deadline, mode, soft, on_soft, io)
+    end
+
+    def reset(parent, budget, deadline, mode, soft = nil, on_soft = nil, io = false)
+      @parent = parent
+      @budget = budget
+      @deadline = deadline
+      @mode = mode
+      @depth = parent ? parent.depth + 1 : 0
+      @expiring = parent && parent.expiring.deadline <= deadline ? parent.expiring : self
+      inherited = parent&.raising
+      @raising = mode == :cooperative || (inherited && inherited.deadline <= deadline) ? inherited : self
+      @soft = soft
+      @on_soft = on_soft
+      @soft_fired = false
+      inherited = parent&.soft_owner
+      inherited = nil if inherited&.soft_fired?
+      @soft_owner = soft && (inherited.nil? || soft < inherited.soft) ? self : inherited
+      @io = io || (parent ? parent.io? : false)
+      @thread_owner = parent&.thread_owner
+      @children = nil
+      @effective_deadline = nil
+      @site = nil
+      @expired = false
+      @retained = false
+      self
+    end
+
+    # Set by the watchdog once the deadline passed. Checkpoints read it through
+    # +expiring+, which costs a flag read instead of a clock read.
+    def expired?
+      @expired
+    end
+
+    def expire!
+      @expired = true
+    end
+
+    # Set by the watchdog once the soft deadline passed.
+    def soft_fired?
+      @soft_fired
+    end
+
+    def soft_fire!
+      @soft_fired = true
+    end
+
+    # The soft deadline to arm before the hard one, if any is still pending.
+    def pending_soft
+      owner = @soft_owner
+      owner if owner && !owner.soft_fired? && owner.soft < @expiring.deadline
+    end
+
+    # Whether the watchdog only flags the scope instead of raising.
+    def cooperative?
+      @mode == :cooperative
+    end
+
+    # Whether blocking IO in the scope is bounded by its deadline.
+    def io?
+      @io
+    end
+
+    # The Deadline this scope is actually bound by: its own or an enclosing
+    # one, whichever is earlier. Built once per scope.
+    def effective_deadline
+      @effective_deadline ||= Deadline.at(@expiring.deadline)
+    end
+
+    # Whether this scope owns a deadline armed for its thread.
+    def armed?
+      @expiring.equal?(self) || @raising.equal?(self) || @soft_owner.equal?(self)
+    end
+
+    # Makes the scope own the threads started in it.
+    def own_threads!
+      @thread_owner = self
+      @children = ThreadPropagation::Children.new
+    end
+
+    # Keeps the scope out of the free list because something outlives it.
+    def retain!
+      @retained = true
+    end
+
+    def retained?
+      @retained
+    end
+
+    # Links a finished scope into a free list.
+    def recycle(next_free)
+      @parent = next_free
+      @expiring = nil
+      @raising = nil
+      @soft_owner = nil
+      @thread_owner = nil
+      @children = nil
+      @on_soft = nil
+      @site = nil
+      @effective_deadline = nil
+      @budget = nil
+    end
+  end
+
+  # Timeout bookkeeping of one thread (or fiber): the innermost scope, the
+  # single timer armed on behalf of the whole stack, and a free list of scopes
+  # so that entering and leaving scopes allocates nothing in steady state.
+  class ThreadState
+    attr_reader :scope
+
+    # Depth of RubyTimeoutSafe.critical and RubyTimeoutSafe.untracked blocks.
+    attr_accessor :critical, :untracked
+
+    def initialize
+      @scope = nil
+      @critical = 0
+      @untracked = 0
+      @free = nil
+      # Depth of critical sections and on_blocking scopes.
+      @held = 0
+      @timer = nil
+      # The watchdog the timer is scheduled in, if any.
+      @watchdog = nil
+    end
+
+    # Pushes a scope. Its deadline is armed in +watchdog+ if it is the earliest
+    # on the stack; pass nil when something else (a fiber scheduler) enforces it.
+    #
+    # #enter and #leave must not be cut short by a TimeoutError: call them
+    # with Timeout::Error held back (Thread.handle_interrupt).
+    def enter(budget, deadline, mode, watchdog, soft = nil, on_soft = nil, io = false)
+      scope = acquire(budget, deadline, mode, soft, on_soft, io)
+      if scope.armed? && watchdog
+        @watchdog ||= watchdog
+        unless @timer
+          @timer = Timer.new(Thread.current, deadline, scope)
+          @timer.held = @held.positive?
+        end
+        arm(scope)
+      end
+      @scope = scope
+    end
+
+    def leave(scope)
+      @scope = scope.parent
+      if scope.armed? && @watchdog
+        if @scope
+          arm(@scope)
+        else
+          @watchdog.cancel(@timer)
+          @watchdog = nil
+        end
+      end
+      release(scope)
+    end
+
+    # Runs the block with the watchdog holding off until +io_grace+ past the
+    # deadline, while a client that was handed the deadline enforces it.
+    def deferring
+      return yield if @watchdog.nil? || @timer.deferred
+
+      Thread.handle_interrupt(DEFER_TIMEOUT) do
+        @timer.deferred = true
+        rearm
+      end
+      begin
+        yield
+      ensure
+        Thread.handle_interrupt(DEFER_TIMEOUT) do
+          @timer.deferred = false
+          rearm
+        end
+      end
+    end
+
+    # Called as timeouts start being held back (critical sections, on_blocking
+    # scopes) and stop, so that signal interruption pauses meanwhile.
+    def hold_signals
+      @held += 1
+      resignal(true) if @held == 1
+    end
+
+    def release_signals
+      @held -= 1
+      resignal(false) if @held.zero?
+    end
+
+    # The innermost scope if blocking IO should be bounded by its deadline:
+    # it is an IO scope, not in a critical section, and the deadline binding
+    # it may raise.
+    def io_scope
+      scope = @scope
+      scope if scope&.io? && @critical.zero? && !scope.expiring.cooperative?
+    end
+
+    private
+      def resignal(held)
+        return unless @timer
+
+        @timer.held = held
+        @watchdog.resignal(@timer) if @watchdog && @timer.signal
+      end
+
+      # Schedules the timer for the innermost scope again, unless it already
+      # fired: that must not happen twice.
+      def rearm
+        arm(@scope) unless @scope.expiring.expired?
+      end
+
+      # Schedules the timer for the innermost +scope+: at the pending soft
+      # deadline if there is one, else at the hard deadline, going on to the
+      # earliest raising deadline if that one is cooperative.
+      def arm(scope)
+        expiring = scope.expiring
+        raising = scope.raising unless scope.raising.equal?(expiring)
+        soft = scope.pending_soft
+        if soft
+          @watchdog.schedule(@timer, soft.soft, expiring, soft, raising)
+        else
+          @watchdog.schedule(@timer, expiring.deadline, expiring, nil, raising)
+        end
+      end
+
+      def acquire(budget, deadline, mode, soft, on_soft, io)
+        scope = @free
+        return Scope.new(@scope, budget, deadline, mode, soft, on_soft, io) unless scope
+
+        @free = scope.parent
+        scope.reset(@scope, budget, deadline, mode, soft, on_soft, io)
+      end
+
+      def release(scope)
+        return if scope.retained?
+
+        scope.recycle(@free)
+        @free = scope
+      end
+  end
+end
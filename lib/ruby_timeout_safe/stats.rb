@@ -0,0 +1,83 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # An Event subscriber that counts scopes and keeps Histograms of how long
+  # blocks took, how much of their budget that was, and how late expiries
+  # stopped, for a metrics exporter to scrape.
+  #
+  #   stats = RubyTimeoutSafe.subscribe(RubyTimeoutSafe::Stats.new)
+  #   stats.snapshot # => { started: 120, expired: 3, overshoot: #<Histogram>, ... }
+  #
+  # Each thread records into a shard of its own, so recording takes no lock
+  # and threads never contend. #snapshot merges the shards; shards of threads
+  # that ended are folded into one then.
+  class Stats
+    COUNTERS = %i[started nested_skipped completed expired].freeze
+    HISTOGRAMS = %i[elapsed budget_used overshoot].freeze
+
+    # The tallies of one thread, written only by that thread.
+    class Shard
+      attr_accessor(*COUNTERS)
+
+      # Histograms: +elapsed+ of completed blocks in nanoseconds, the
+      # +budget_used+ by them in percent, and +overshoot+ of expired ones in
+      # nanoseconds.
+      attr_reader(*HISTOGRAMS)
+
+      def initialize
+        COUNTERS.each { |counter| instance_variable_set(:"@#{counter}", 0) }
+        HISTOGRAMS.each { |histogram| instance_variable_set(:"@#{histogram}", Histogram.new) }
+      end
+
+      def merge(other)
+        COUNTERS.each { |counter| public_send(:"#{counter}=", public_send(counter) + other.public_send(counter)) }
+        HISTOGRAMS.each { |histogram| public_send(histogram).merge(other.public_send(histogram)) }
+        self
+      end
+
+      def to_h
+        (COUNTERS + HISTOGRAMS).to_h { |name| [name, public_send(name)] }
+      end
+    end
+
+    def initialize
+      @mutex = Thread::Mutex.new
+      # Read without the lock; only threads adding their shard write it.
+      @shards = {}.compare_by_identity
+      @retired = Shard.new
+    end
+
+    def call(event)
+      shard = @shards[Thread.current] || add_shard
+      case event.type
+      when :start
+        shard.started += 1
+      when :nested_skip
+        shard.nested_skipped += 1
+      when :complete
+        shard.completed += 1
+        shard.elapsed.record(event.elapsed)
+        used = event.budget_used
+        shard.budget_used.record((used * 100).round) if used
+      when :expire
+        shard.expired += 1
+        shard.overshoot.record(event.overshoot)
+      end
+    end
+
+    # Totals across all threads so far: the COUNTERS as integers and the
+    # HISTOGRAMS as merged copies. Counts of threads busy meanwhile may be off
+    # by the events they are recording.
+    def snapshot
+      @mutex.synchronize do
+        @shards.keys.reject(&:alive?).each { |thread| @retired.merge(@shards.delete(thread)) }
+        @shards.each_value.with_object(Shard.new.merge(@retired)) { |shard, total| total.merge(shard) }.to_h
+      end
+    end
+
+    private
+      def add_shard
+        @mutex.synchronize { @shards[Thread.current] = Shard.new }
+      end
+  end
+end
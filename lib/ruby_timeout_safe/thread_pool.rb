@@ -0,0 +1,83 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # A bounded pool of threads for ::map. Threads are started as jobs arrive
+  # and none is idle, up to +size+; after that jobs queue. Threads then wait
+  # for the next job instead of exiting, so later calls reuse them.
+  #
+  # Pool threads are started ::untracked, so they never belong to the
+  # <tt>threads: true</tt> scope that happened to start them. They do not
+  # survive a fork; the child starts its own as needed.
+  class ThreadPool
+    attr_reader :size
+
+    def initialize(size:)
+      raise ArgumentError, 'size must be a positive integer' unless size.is_a?(Integer) && size.positive?
+
+      @size = size
+      @mutex = Thread::Mutex.new
+      @jobs = Thread::Queue.new
+      @threads = []
+      # Threads waiting for a job that no #post has claimed yet.
+      @idle = 0
+      @pid = Process.pid
+    end
+
+    # Runs the block on a pool thread.
+    def post(&job)
+      raise ArgumentError, 'a job block is required' unless job
+
+      @mutex.synchronize do
+        raise ClosedQueueError, 'thread pool is shut down' if @jobs.closed?
+
+        forget_threads unless @pid == Process.pid
+        if @idle.positive?
+          @idle -= 1
+        elsif @threads.size < @size
+          @threads << start_thread
+        end
+        @jobs << job
+      end
+      nil
+    end
+
+    # The number of threads started so far.
+    def length
+      @mutex.synchronize { @threads.size }
+    end
+
+    # Lets the threads exit once the jobs already posted are done. Does not
+    # wait for them.
+    def shutdown
+      @jobs.close
+      nil
+    end
+
+    private
+      def start_thread
+        thread = RubyTimeoutSafe.untracked { Thread.new { work } }
+        thread.name = 'ruby_timeout_safe pool'
+        thread
+      end
+
+      def work
+        while (job = @jobs.pop)
+          begin
+            job.call
+          rescue Exception => e # a job's error must not cost the pool a thread
+            warn("ruby_timeout_safe: pool job failed: #{e.class}: #{e.message}")
+          end
+          @mutex.synchronize { @idle += 1 }
+        end
+      end
+
+      # In a forked child: the parent's threads are gone, and so is whoever
+      # posted the jobs still queued.
+      def forget_threads
+        @jobs = Thread::Queue.new
+        @threads = []
+        @idle = 0
+        @pid = Process.pid
+      end
+  end
+end
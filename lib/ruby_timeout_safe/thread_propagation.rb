@@ -0,0 +1,155 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # Makes threads started inside a <tt>threads: true</tt> scope children of
+  # it. Each child runs its block in a scope of its own, bound by the deadline
+  # and mode of the scope it was started in, so the watchdog interrupts it when
+  # the deadline passes. When the owning scope ends, children still running
+  # get a CancelledError, and the scope waits up to +cancel_grace+ for them to
+  # unwind before killing them.
+  #
+  # Prepended to Thread's singleton class the first time such a scope starts.
+  # Outside such scopes, starting a thread costs one more thread-local read.
+  module ThreadPropagation
+    # A thread inherits the interrupt mask of the one starting it, so a child
+    # starts with cancellation held back until it can rescue it.
+    HOLD_CANCEL = { CancelledError => :never }.compare_by_identity.freeze
+    ALLOW_CANCEL = { CancelledError => :immediate }.compare_by_identity.freeze
+
+    # The threads a scope owns, and how many of them are still running their
+    # block. Children check out as their block ends, so that the scope can
+    # wait for them without Thread#join, which raises their errors.
+    class Children
+      def initialize
+        @mutex = Thread::Mutex.new
+        @finished = Thread::ConditionVariable.new
+        @threads = []
+        @running = 0
+      end
+
+      # Counts a child before it is started, so that it cannot finish first.
+      def starting
+        @mutex.synchronize { @running += 1 }
+      end
+
+      def started(thread)
+        @mutex.synchronize { @threads << thread }
+      end
+
+      def finished
+        @mutex.synchronize do
+          @running -= 1
+          @finished.broadcast if @running.zero?
+        end
+      end
+
+      def running?
+        @mutex.synchronize { @running.positive? }
+      end
+
+      def alive
+        @mutex.synchronize { @threads.select(&:alive?) }
+      end
+
+      # Waits up to +seconds+ for every child to finish; whether they did.
+      def wait(seconds)
+        deadline = Clock.deadline_in(seconds)
+        @mutex.synchronize do
+          while @running.positive?
+            remaining = deadline - Clock.now
+            return false unless remaining.positive?
+
+            @finished.wait(@mutex, remaining.fdiv(Clock::NANOSECONDS_PER_SECOND))
+          end
+          true
+        end
+      end
+    end
+
+    def new(*args, &block)
+      owner = ThreadPropagation.owner
+      return super unless owner && block
+
+      ThreadPropagation.spawn(owner, block) { |child| super(*args, &child) }
+    end
+
+    def start(*args, &block)
+      owner = ThreadPropagation.owner
+      return super unless owner && block
+
+      ThreadPropagation.spawn(owner, block) { |child| super(*args, &child) }
+    end
+    alias fork start
+
+    def self.install
+      Thread.singleton_class.prepend(self) unless Thread.singleton_class <= self
+    end
+
+    # The scope owning threads started now, if any.
+    def self.owner
+      state = Thread.current[STATE_KEY]
+      state.scope&.thread_owner if state && state.untracked.zero?
+    end
+
+    # Starts a child of +owner+ running +block+, by yielding the block the
+    # thread should run instead.
+    def self.spawn(owner, block)
+      children = owner.children
+      child = child(owner, children, block)
+      children.starting
+      begin
+        thread = Thread.handle_interrupt(HOLD_CANCEL) { yield child }
+      rescue StandardError
+        children.finished
+        raise
+      end
+      children.started(thread)
+      thread
+    end
+
+    # The block a child of +owner+ runs instead of +block+.
+    def self.child(owner, children, block)
+      scope = Thread.current[STATE_KEY].scope
+      deadline = scope.effective_deadline
+      mode = scope.mode
+      io = scope.io?
+      proc do |*args|
+        Thread.handle_interrupt(ALLOW_CANCEL) do
+          RubyTimeoutSafe.timeout(deadline, mode: mode, io: io, threads: true) { block.call(*args) }
+        end
+      rescue CancelledError => e
+        raise unless e.scope.equal?(owner)
+        # Cancelled while unwinding from the deadline both share: the
+        # timeout is what happened to it.
+        timed_out(e.cause) if e.cause.is_a?(TimeoutError)
+      rescue TimeoutError => e
+        timed_out(e)
+      ensure
+        children.finished
+      end
+    end
+
+    # Leaves +error+, expected once the deadline passed, to whoever joins the
+    # thread, without reporting it.
+    def self.timed_out(error)
+      Thread.current.report_on_exception = false
+      raise error, cause: nil
+    end
+    private_class_method :timed_out
+
+    # Cancels the children of +scope+ that are still running, waits up to
+    # +cancel_grace+ for them to finish and kills those that have not. Their
+    # errors are left to whoever joins them; errors raised into this thread
+    # meanwhile, such as an enclosing scope's TimeoutError, go on up.
+    def self.reap(scope)
+      children = scope.children
+      return unless children.running?
+
+      scope.retain!
+      children.alive.each { |thread| thread.raise(CancelledError.new('scope exited', scope)) }
+      return if children.wait(RubyTimeoutSafe.settings[:cancel_grace])
+
+      children.alive.each(&:kill)
+    end
+  end
+end
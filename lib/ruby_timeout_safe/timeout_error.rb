@@ -0,0 +1,28 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # Raised in a thread whose timeout scope expired. +scope+ is the Scope whose
+  # deadline passed, which may enclose the scope that was running.
+  class TimeoutError < Timeout::Error
+    attr_reader :scope
+
+    def initialize(message = 'execution expired', scope = nil)
+      super(message)
+      @scope = scope
+    end
+
+    # Marshalled without the scope, which may hold procs, mutexes and its whole
+    # parent chain. An error sent back from a forked child (isolate: :process,
+    # WorkerPool) so arrives with a nil scope.
+    def _dump(_level)
+      Marshal.dump([message, backtrace])
+    end
+
+    def self._load(data)
+      message, backtrace = Marshal.load(data)
+      error = new(message)
+      error.set_backtrace(backtrace) if backtrace
+      error
+    end
+  end
+end
@@ -0,0 +1,57 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # A deadline registered with the Watchdog on behalf of a thread.
+  class Timer
+    attr_reader :thread
+
+    # Monotonic nanoseconds, and the Scope reported when it passes.
+    attr_accessor :deadline, :scope
+
+    # The Scope whose soft deadline +deadline+ currently is, if any. When it
+    # passes the timer is re-keyed to the hard deadline of +scope+.
+    attr_accessor :soft_scope
+
+    # Position in the TimerHeap, or nil once the timer left it.
+    attr_accessor :index
+
+    # TimingWheel bucket holding the timer and its neighbours in that bucket.
+    attr_accessor :bucket, :prev_timer, :next_timer
+
+    # The Scope the timer is re-keyed to once the cooperative +scope+ has
+    # been flagged, if a later one on the stack raises.
+    attr_accessor :raising
+
+    # Whether a client enforces the deadline itself for now, so that the
+    # watchdog holds off like for an IO scope.
+    attr_accessor :deferred
+
+    # Native::SignalTimer aimed at the thread, once signal interruption used it.
+    attr_accessor :signal
+
+    # Whether the thread holds timeouts back for now, so that no signals are
+    # sent to it: they would only fail its blocking calls with EINTR again
+    # and again.
+    attr_accessor :held
+
+    # For CPU-time scopes: the thread's CPU clock id, and the reading of it at
+    # which the timer fires. +deadline+ is then only when to look next.
+    attr_accessor :cpu_clock, :cpu_deadline
+
+    def initialize(thread, deadline, scope = nil)
+      @thread = thread
+      @deadline = deadline
+      @scope = scope
+      @soft_scope = nil
+      @raising = nil
+      @index = nil
+      @bucket = nil
+      @prev_timer = nil
+      @next_timer = nil
+      @signal = nil
+      @held = false
+      @cpu_clock = nil
+      @cpu_deadline = nil
+    end
+  end
+end
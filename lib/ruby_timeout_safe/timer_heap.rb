@@ -0,0 +1,104 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # Binary min-heap of timers ordered by deadline. Each timer remembers its
+  # slot so it can be removed in O(log n) when its scope finishes early.
+  class TimerHeap
+    def initialize
+      @timers = []
+    end
+
+    def size
+      @timers.size
+    end
+
+    def empty?
+      @timers.empty?
+    end
+
+    def peek
+      @timers.first
+    end
+
+    # Earliest deadline in the heap, or nil when it is empty.
+    def next_deadline
+      @timers.first&.deadline
+    end
+
+    # Removes and yields every timer whose deadline is at or before +now+.
+    def expire(now)
+      while (timer = @timers.first) && timer.deadline <= now
+        delete(timer)
+        yield timer
+      end
+    end
+
+    def push(timer)
+      timer.index = @timers.size
+      @timers << timer
+      sift_up(timer.index)
+      timer
+    end
+
+    def pop
+      return if @timers.empty?
+
+      delete(@timers.first)
+    end
+
+    def delete(timer)
+      index = timer.index
+      return unless index && @timers[index].equal?(timer)
+
+      last = @timers.pop
+      unless last.equal?(timer)
+        @timers[index] = last
+        last.index = index
+        sift_down(index)
+        sift_up(last.index)
+      end
+      timer.index = nil
+      timer
+    end
+
+    def clear
+      @timers.each { |timer| timer.index = nil }
+      @timers.clear
+    end
+
+    private
+      def sift_up(index)
+        timer = @timers[index]
+        while index.positive?
+          parent = (index - 1) >> 1
+          break if @timers[parent].deadline <= timer.deadline
+
+          place(@timers[parent], index)
+          index = parent
+        end
+        place(timer, index)
+      end
+
+      def sift_down(index)
+        timer = @timers[index]
+        size = @timers.size
+        loop do
+          child = (index << 1) + 1
+          break if child >= size
+
+          right = child + 1
+          child = right if right < size && @timers[right].deadline < @timers[child].deadline
+          break if timer.deadline <= @timers[child].deadline
+
+          place(@timers[child], index)
+          index = child
+        end
+        place(timer, index)
+      end
+
+      def place(timer, index)
+        @timers[index] = timer
+        timer.index = index
+      end
+  end
+end
@@ -0,0 +1,168 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # Hierarchical hashed timing wheel. Each level has SLOTS buckets; a bucket on
+  # level +n+ spans SLOTS**n ticks, and its timers are cascaded one level down
+  # when the wheel reaches it. Registering and cancelling are O(1) regardless of
+  # how many timers are armed, which suits scopes that mostly finish early.
+  #
+  # Timers fire at most one tick after their deadline, never before it.
+  class TimingWheel
+    BITS = 6
+    SLOTS = 1 << BITS
+    MASK = SLOTS - 1
+
+    # 1 ms ticks over 8 levels cover Clock::FOREVER without clamping.
+    DEFAULT_TICK = 1_000_000
+    DEFAULT_LEVELS = 8
+
+    # A circular doubly-linked list of timers headed by the bucket itself, so
+    # linking and unlinking never allocate.
+    class Bucket
+      attr_accessor :prev_timer, :next_timer
+
+      def initialize
+        @prev_timer = self
+        @next_timer = self
+      end
+
+      def empty?
+        @next_timer.equal?(self)
+      end
+
+      def push(timer)
+        timer.bucket = self
+        timer.prev_timer = @prev_timer
+        timer.next_timer = self
+        @prev_timer.next_timer = timer
+        @prev_timer = timer
+      end
+
+      def unlink(timer)
+        timer.prev_timer.next_timer = timer.next_timer
+        timer.next_timer.prev_timer = timer.prev_timer
+        timer.bucket = timer.prev_timer = timer.next_timer = nil
+      end
+    end
+
+    attr_reader :size, :resolution
+
+    # +tick+ is the bucket resolution in nanoseconds.
+    def initialize(tick: DEFAULT_TICK, levels: DEFAULT_LEVELS)
+      raise ArgumentError, 'tick must be a positive number of nanoseconds' unless tick.is_a?(Integer) && tick.positive?
+      raise ArgumentError, 'levels must be at least 1' unless levels.is_a?(Integer) && levels.positive?
+
+      @resolution = tick
+      @levels = Array.new(levels) { Array.new(SLOTS) { Bucket.new } }
+      @horizon = (SLOTS**levels) - 1
+      @size = 0
+      # The next tick to be processed.
+      @current = Clock.now / tick
+    end
+
+    def empty?
+      @size.zero?
+    end
+
+    def push(timer)
+      place(timer)
+      @size += 1
+      timer
+    end
+
+    def delete(timer)
+      bucket = timer.bucket
+      return unless bucket
+
+      bucket.unlink(timer)
+      @size -= 1
+      timer
+    end
+
+    def clear
+      @levels.each do |buckets|
+        buckets.each { |bucket| delete(bucket.next_timer) until bucket.empty? }
+      end
+    end
+
+    # The start of the next tick with work to do: a level 0 bucket to expire or
+    # a higher bucket to cascade. This may be earlier than any deadline.
+    def next_deadline
+      tick = next_tick
+      tick && (tick * @resolution)
+    end
+
+    # Removes and yields every timer whose deadline is at or before +now+.
+    def expire(now)
+      target = now / @resolution
+      while @current <= target
+        tick = next_tick
+        if tick.nil? || tick > target
+          @current = target + 1
+          break
+        end
+
+        @current = tick
+        cascade(tick) if (tick & MASK).zero?
+        bucket = @levels[0][tick & MASK]
+        @current = tick + 1
+        until bucket.empty?
+          timer = bucket.next_timer
+          delete(timer)
+          yield timer
+        end
+      end
+    end
+
+    private
+      def place(timer)
+        expires = -(-timer.deadline / @resolution)
+        delta = expires - @current
+        if delta.negative?
+          expires = @current
+          delta = 0
+        elsif delta > @horizon
+          # Parked at the edge of the wheel; re-placed when cascaded.
+          expires = @current + @horizon
+          delta = @horizon
+        end
+
+        level = delta.zero? ? 0 : (delta.bit_length - 1) / BITS
+        @levels[level][(expires >> (level * BITS)) & MASK].push(timer)
+      end
+
+      # Moves the timers of the buckets that start at +tick+ down the wheel.
+      def cascade(tick)
+        (1...@levels.size).each do |level|
+          index = (tick >> (level * BITS)) & MASK
+          bucket = @levels[level][index]
+          until bucket.empty?
+            timer = bucket.next_timer
+            bucket.unlink(timer)
+            place(timer)
+          end
+          break unless index.zero?
+        end
+      end
+
+      def next_tick
+        return if @size.zero?
+
+        earliest = nil
+        @levels.each_with_index do |buckets, level|
+          shift = level * BITS
+          # First block on this level whose bucket has not been cascaded yet.
+          block = (@current + (1 << shift) - 1) >> shift
+          SLOTS.times do |distance|
+            tick = (block + distance) << shift
+            break if earliest && tick >= earliest
+            next if buckets[(block + distance) & MASK].empty?
+
+            earliest = tick
+            break
+          end
+        end
+        earliest
+      end
+  end
+end
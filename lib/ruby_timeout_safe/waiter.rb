@@ -0,0 +1,39 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # Pure-Ruby fallback for the native waiters: blocks the watchdog thread on a
+  # condition variable until exactly the armed deadline, and sleeps
+  # indefinitely while nothing is armed.
+  class Waiter
+    def initialize
+      @deadline = nil
+      @mutex = Thread::Mutex.new
+      @condvar = Thread::ConditionVariable.new
+    end
+
+    # Sets the deadline (monotonic nanoseconds) #wait returns at; nil disarms.
+    # Wakes a waiting thread so it picks up the new deadline.
+    def arm(deadline)
+      @mutex.synchronize do
+        @deadline = deadline
+        @condvar.signal
+      end
+    end
+
+    def wait
+      @mutex.synchronize do
+        loop do
+          deadline = @deadline
+          if deadline.nil?
+            @condvar.wait(@mutex)
+          else
+            remaining = deadline - Clock.now
+            break unless remaining.positive?
+
+            @condvar.wait(@mutex, remaining.fdiv(Clock::NANOSECONDS_PER_SECOND))
+          end
+        end
+      end
+    end
+  end
+end
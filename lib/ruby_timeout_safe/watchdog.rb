@@ -0,0 +1,258 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # A single, lazily started thread that enforces the deadlines of every active
+  # timeout scope in the process. Each thread with active scopes has one Timer
+  # scheduled in it, moved as its scopes start and end and cancelled when the
+  # last one returns, so no thread is created per call.
+  #
+  # The thread blocks in a waiter (Waiter, or one from the native extension)
+  # armed with the earliest deadline, and only runs Ruby code when it passes.
+  #
+  # Thread#raise cannot reach a thread stuck in a system call that holds the
+  # GVL or restarts on its own. With +signal_interval+ set, each timer also
+  # arms a Native::SignalTimer that signals the thread +signal_interval+ after
+  # its deadline, and again at that interval, so the call fails with EINTR and
+  # the pending TimeoutError is delivered. Signals pause while the thread
+  # holds timeouts back (Timer#held).
+  #
+  # For scopes bounding their IO waits by the deadline (Scope#io?), and while
+  # a client enforces the deadline itself (Timer#deferred), the watchdog is
+  # only a backstop: it fires +io_grace+ after the deadline, so that those
+  # calls fail there on their own first.
+  class Watchdog
+    # Profiler told about every expiry, or nil.
+    attr_accessor :profiler
+
+    # +timers+ is the deadline store: a TimerHeap or a TimingWheel.
+    # +waiter_class+ builds the waiter for each watchdog thread.
+    # +signal_interval+ and +io_grace+ are in nanoseconds; nil leaves signals
+    # off.
+    def initialize(timers = TimerHeap.new, waiter_class = Waiter, signal_interval: nil, io_grace: 0)
+      @timers = timers
+      @waiter_class = waiter_class
+      @signal_interval = signal_interval
+      @io_grace = io_grace
+      @waiter = nil
+      @armed = nil
+      @mutex = Thread::Mutex.new
+      @profiler = nil
+      # Timers to put back after an expiry pass, and soft deadline callbacks
+      # to run outside the lock, as [callback, scope, thread] triples.
+      @requeue = []
+      @warnings = []
+      @thread = nil
+      @pid = nil
+      @retired = false
+    end
+
+    # Arms a budget of +thread+'s CPU time, read from +clock+ (see
+    # Clock.thread_cpu_id), to end at the reading +cpu_deadline+. A thread
+    # spends CPU time no faster than wall time, so the watchdog first looks
+    # once the remaining CPU budget has passed on the wall clock, then again
+    # after whatever is still left, until it is used up.
+    def register_cpu(thread, clock, cpu_deadline, scope)
+      timer = Timer.new(thread, nil, scope)
+      timer.cpu_clock = clock
+      timer.cpu_deadline = cpu_deadline
+      schedule(timer, Clock.now + cpu_deadline - Clock.cpu_now(clock), scope)
+    end
+
+    # Arms +timer+ for a new deadline and scope. Works for timers that are
+    # pending, cancelled or already fired, so callers can reuse one timer.
+    # With signals on, call it from the timer's own thread.
+    #
+    # With +soft_scope+, +deadline+ is that scope's soft deadline: the
+    # watchdog runs its +on_soft+ callback there and keeps the timer for the
+    # hard deadline of +scope+. With +raising+, a later scope that raises,
+    # the timer goes on to that one's deadline once the cooperative +scope+
+    # has been flagged.
+    def schedule(timer, deadline, scope, soft_scope = nil, raising = nil)
+      deadline = backstop(timer, scope, deadline) unless soft_scope
+      @mutex.synchronize do
+        start unless running?
+        @timers.delete(timer)
+        timer.deadline = deadline
+        timer.scope = scope
+        timer.soft_scope = soft_scope
+        timer.raising = raising
+        push(timer)
+      end
+      signal(timer, scope, raising, soft_scope || raising ? nil : deadline)
+      timer
+    end
+
+    # Stops or resumes the signals aimed at +timer+'s thread after
+    # Timer#held changed. Call it from the timer's own thread.
+    def resignal(timer)
+      scope, raising, deadline = @mutex.synchronize { [timer.scope, timer.raising, timer.deadline] }
+      signal(timer, scope, raising, timer.soft_scope || raising ? nil : deadline)
+    end
+
+    # Disarms +timer+. A timer that already fired is left alone, apart from
+    # stopping its signals.
+    def cancel(timer)
+      @mutex.synchronize do
+        @timers.delete(timer)
+        arm(Clock.now) if @retired && @timers.size.zero? && running?
+      end
+      timer.signal&.disarm
+    end
+
+    # Ends the thread once no timers are left, for a watchdog that ::configure
+    # replaced: scopes already running on it keep it until they finish. One
+    # that is scheduled again starts a thread again, and ends it likewise.
+    def retire
+      @mutex.synchronize do
+        @retired = true
+        # Wakes the thread to find nothing left.
+        arm(Clock.now) if @timers.size.zero? && running?
+      end
+      nil
+    end
+
+    # Number of timers currently armed.
+    def size
+      @mutex.synchronize { @timers.size }
+    end
+
+    private
+      # Aims the signals at +hard+, or the hard deadline of the scope that
+      # raises when it is nil, unless the thread holds timeouts back.
+      def signal(timer, scope, raising, hard)
+        raiser = scope&.cooperative? ? raising : scope
+        if @signal_interval && (raiser || scope.nil?) && !timer.cpu_clock && !timer.held
+          hard ||= backstop(timer, raiser, raiser.deadline)
+          (timer.signal ||= Native::SignalTimer.new).arm(hard + @signal_interval, @signal_interval)
+        else
+          timer.signal&.disarm
+        end
+      end
+
+      def running?
+        @pid == Process.pid && @thread&.alive?
+      end
+
+      def start
+        # A forked child inherits the parent's timers but none of its threads,
+        # and the waiter may have been locked by the parent's watchdog.
+        @timers.clear unless @pid == Process.pid
+        @pid = Process.pid
+        @waiter = @waiter_class.new
+        @armed = nil
+        # Not a child of whatever scope is starting it.
+        @thread = RubyTimeoutSafe.untracked { Thread.new { run(@waiter) } }
+        @thread.name = 'ruby_timeout_safe'
+      end
+
+      def run(waiter)
+        loop do
+          waiter.wait
+          done = @mutex.synchronize do
+            expire(Clock.now)
+            next stop if @retired && @timers.size.zero?
+
+            arm(@timers.next_deadline)
+            false
+          end
+          warn_soft unless @warnings.empty?
+          break if done
+        end
+      end
+
+      # Lets the running thread end. A later #schedule starts a new one.
+      def stop
+        @thread = nil
+        @waiter = nil
+        @armed = nil
+        true
+      end
+
+      def push(timer)
+        @timers.push(timer)
+        arm(@timers.next_deadline) if @armed.nil? || timer.deadline < @armed
+      end
+
+      def arm(deadline)
+        @armed = deadline
+        @waiter.arm(deadline)
+      end
+
+      def expire(now)
+        @timers.expire(now) do |timer|
+          next if timer.cpu_clock && resample(timer, now)
+          next if timer.soft_scope && soften(timer)
+
+          scope = timer.scope
+          @profiler&.record(scope, timer.thread)
+          if scope
+            scope.expire!
+            if scope.cooperative?
+              escalate(timer) if timer.raising
+              next
+            end
+
+            scope.retain!
+          end
+          timer.thread.raise(TimeoutError.new('execution expired', scope))
+        end
+        @requeue.each { |timer| @timers.push(timer) }
+        @requeue.clear
+      end
+
+      # Queues the soft deadline callback and keeps the timer for the hard
+      # deadline.
+      def soften(timer)
+        soft = timer.soft_scope
+        timer.soft_scope = nil
+        soft.soft_fire!
+        # The callback may run after the scope finished; keep it intact.
+        soft.retain!
+        @warnings.push(soft.on_soft, soft, timer.thread)
+        timer.deadline = backstop(timer, timer.scope, timer.scope.deadline)
+        @requeue << timer
+        true
+      end
+
+      # Keeps the timer of a flagged cooperative scope for the earliest
+      # deadline on the stack that raises.
+      def escalate(timer)
+        raising = timer.raising
+        timer.raising = nil
+        timer.scope = raising
+        timer.deadline = backstop(timer, raising, raising.deadline)
+        @requeue << timer
+      end
+
+      # Runs queued soft deadline callbacks on the watchdog thread, outside the
+      # lock so that they may use the library themselves.
+      def warn_soft
+        until @warnings.empty?
+          callback, scope, thread = @warnings.shift(3)
+          begin
+            callback.call(scope, thread)
+          rescue StandardError => e
+            warn("ruby_timeout_safe: on_soft callback failed: #{e.class}: #{e.message}")
+          end
+        end
+      end
+
+      # When to enforce the hard +deadline+ of +scope+.
+      def backstop(timer, scope, deadline)
+        scope&.io? || timer.deferred ? deadline + @io_grace : deadline
+      end
+
+      # Puts a CPU-time timer back for later if its budget is not used up yet.
+      # Timers of threads that are gone are dropped.
+      def resample(timer, now)
+        left = timer.cpu_deadline - Clock.cpu_now(timer.cpu_clock)
+        return false unless left.positive?
+
+        timer.deadline = now + left
+        @requeue << timer
+        true
+      rescue SystemCallError
+        true
+      end
+  end
+end
@@ -0,0 +1,219 @@
+# frozen_string_literal: true
+
+module RubyTimeoutSafe
+  # Pre-forked worker processes for hard timeouts without a fork per call.
+  #
+  #   pool = RubyTimeoutSafe::WorkerPool.new(size: 4, recycle_after: 1000) { |path| thumbnail(path) }
+  #   pool.call('photo.jpg', timeout: 2)
+  #
+  # Workers are forked once, after Process.warmup where available, so they
+  # share the warmed heap copy-on-write. Each job is the handler's arguments
+  # sent as one length-prefixed Marshal frame; the result or error comes back
+  # the same way. A worker still busy at the deadline is SIGKILLed and
+  # replaced, and the caller gets TimeoutError as from ::timeout. Inside the
+  # handler, ::current_deadline and ::check! see the caller's deadline.
+  class WorkerPool
+    # Frame length, 32-bit big-endian.
+    HEADER = 'N'
+    HEADER_SIZE = 4
+
+    # A forked worker and the parent's ends of its pipes.
+    class Worker
+      attr_reader :pid, :jobs, :results
+      attr_accessor :served
+
+      def initialize(pid, jobs, results)
+        @pid = pid
+        @jobs = jobs
+        @results = results
+        @served = 0
+      end
+
+      def close
+        @jobs.close
+        @results.close
+      end
+    end
+
+    attr_reader :size, :recycle_after
+
+    # +size+ workers are forked right away. Each is replaced after
+    # +recycle_after+ jobs (nil: never). The block handles one job.
+    def initialize(size:, recycle_after: nil, &handler)
+      raise ArgumentError, 'a handler block is required' unless handler
+      raise ArgumentError, 'size must be positive' unless size.positive?
+      raise ArgumentError, 'recycle_after must be positive' if recycle_after && !recycle_after.positive?
+      raise NotImplementedError, 'WorkerPool needs Process.fork' unless Process.respond_to?(:fork)
+
+      @size = size
+      @recycle_after = recycle_after
+      @handler = handler
+      @mutex = Thread::Mutex.new
+      @available = Thread::ConditionVariable.new
+      @idle = []
+      @workers = []
+      @closed = false
+      Process.warmup if Process.respond_to?(:warmup)
+      size.times { @idle << fork_worker }
+    end
+
+    # Runs the handler with +args+ in a worker and returns its value or raises
+    # its error. Raises TimeoutError if no worker is free, or the job is not
+    # done, by +timeout+ seconds or an earlier enclosing deadline.
+    def call(*args, timeout: nil)
+      RubyTimeoutSafe.timeout(timeout, mode: :cooperative) do
+        deadline = RubyTimeoutSafe.current_deadline&.at || Clock::FOREVER
+        job = Marshal.dump([deadline, args])
+        worker = checkout(deadline)
+        begin
+          reply = run(worker, job, deadline)
+        ensure
+          # Anything but a reply leaves the worker in an unknown state.
+          reply.is_a?(String) ? checkin(worker) : replace(worker)
+        end
+        expired unless reply.is_a?(String)
+        kind, value = Marshal.load(reply)
+        raise value if kind == :error
+
+        value
+      end
+    end
+
+    # Stops every idle worker; busy ones stop when they are checked back in.
+    def shutdown
+      workers = @mutex.synchronize do
+        @closed = true
+        @available.broadcast
+        @idle.slice!(0..)
+      end
+      workers.each { |worker| retire(worker) }
+      nil
+    end
+
+    private
+      def checkout(deadline)
+        @mutex.synchronize do
+          loop do
+            raise IsolationError, 'worker pool is shut down' if @closed
+            return @idle.pop unless @idle.empty?
+
+            remaining = deadline - Clock.now
+            expired unless remaining.positive?
+
+            @available.wait(@mutex, remaining.fdiv(Clock::NANOSECONDS_PER_SECOND))
+          end
+        end
+      end
+
+      def checkin(worker)
+        worker.served += 1
+        return release(worker) unless @recycle_after && worker.served >= @recycle_after
+
+        # Idle, so closing its pipes is enough: it exits at EOF.
+        retire(worker)
+        release(fork_worker) unless @closed
+      end
+
+      def release(worker)
+        closed = @mutex.synchronize do
+          @idle << worker unless @closed
+          @available.signal
+          @closed
+        end
+        retire(worker) if closed
+      end
+
+      # Sends the job and returns the reply frame, :expired when the deadline
+      # passed first, or raises IsolationError if the worker died.
+      def run(worker, job, deadline)
+        write_frame(worker.jobs, job)
+        length = read(worker.results, HEADER_SIZE, deadline)
+        return length unless length.is_a?(String)
+
+        read(worker.results, length.unpack1(HEADER), deadline)
+      rescue Errno::EPIPE
+        raise IsolationError, "worker #{worker.pid} exited"
+      end
+
+      # Exactly +size+ bytes, or :expired.
+      def read(io, size, deadline)
+        buffer = String.new(capacity: size)
+        while buffer.bytesize < size
+          remaining = deadline - Clock.now
+          return :expired unless remaining.positive?
+          return :expired unless io.wait_readable(remaining.fdiv(Clock::NANOSECONDS_PER_SECOND))
+
+          chunk = io.read_nonblock(size - buffer.bytesize, exception: false)
+          raise IsolationError, 'worker exited without a result' if chunk.nil?
+
+          buffer << chunk if chunk.is_a?(String)
+        end
+        buffer
+      end
+
+      def write_frame(io, payload)
+        io.write([payload.bytesize].pack(HEADER), payload)
+      end
+
+      def expired
+        scope = RubyTimeoutSafe.current_scope.expiring
+        scope.expire!
+        scope.retain!
+        raise TimeoutError.new('execution expired', scope)
+      end
+
+      def replace(worker)
+        begin
+          Process.kill(:KILL, worker.pid)
+        rescue Errno::ESRCH
+          nil
+        end
+        retire(worker)
+        release(fork_worker) unless @closed
+      end
+
+      def retire(worker)
+        @mutex.synchronize { @workers.delete(worker) }
+        worker.close
+        Process.detach(worker.pid)
+      end
+
+      def fork_worker
+        jobs_reader, jobs = IO.pipe
+        results, results_writer = IO.pipe
+        @mutex.synchronize do
+          pid = fork do
+            # Forked from inside the caller's scope, which must not enclose
+            # the jobs.
+            Thread.current[STATE_KEY] = nil
+            # Holding another worker's pipes would keep it from seeing EOF.
+            @workers.each(&:close)
+            jobs.close
+            results.close
+            serve(jobs_reader, results_writer)
+          ensure
+            exit!(0)
+          end
+          @workers << Worker.new(pid, jobs, results)
+          @workers.last
+        end
+      ensure
+        jobs_reader&.close
+        results_writer&.close
+      end
+
+      def serve(jobs, results)
+        # Frames are read whole: nothing in the worker competes with the job.
+        while (header = jobs.read(HEADER_SIZE))
+          deadline, args = Marshal.load(jobs.read(header.unpack1(HEADER)))
+          reply = begin
+            value = RubyTimeoutSafe.timeout(Deadline.at(deadline), mode: :cooperative) { @handler.call(*args) }
+            Isolation.dump(:ok, value)
+          rescue Exception => e # everything, the caller re-raises it
+            Isolation.dump(:error, e)
+          end
+          write_frame(results, reply)
+        end
+      end
+  end
+end
@@ -0,0 +1,36 @@
+# frozen_string_literal: true
+
+RSpec.describe RubyTimeoutSafe::Deadline do
+  it 'counts down the remaining budget' do
+    deadline = described_class.in(0.5)
+
+    expect(deadline.remaining).to be_within(0.05).of(0.5)
+    expect(deadline.remaining_ns).to be > 0
+    expect(deadline).not_to be_expired
+  end
+
+  it 'reports zero remaining once expired' do
+    deadline = described_class.in(0.001)
+    sleep 0.005
+
+    expect(deadline).to be_expired
+    expect(deadline.remaining).to eq(0.0)
+  end
+
+  it 'composes with min' do
+    early = described_class.in(1)
+    late = described_class.in(2)
+
+    expect(late.min(early)).to equal(early)
+    expect(early.min(late)).to equal(early)
+    expect(early.min(nil)).to equal(early)
+    expect(early).to be < late
+  end
+
+  it 'reads the remaining budget without allocating' do
+    deadline = described_class.in(10)
+    read = -> { 1000.times { deadline.remaining && deadline.expired? } }
+
+    expect(allocated_objects(&read)).to eq(0)
+  end
+end
@@ -0,0 +1,31 @@
+# frozen_string_literal: true
+
+RSpec.describe RubyTimeoutSafe::Histogram do
+  subject(:histogram) { described_class.new }
+
+  it 'reports percentiles within the bucket precision' do
+    (1..10_000).each { |value| histogram.record(value * 1000) }
+
+    expect(histogram.percentile(50)).to be_within(5_000_000 / 60).of(5_000_000)
+    expect(histogram.percentile(99.9)).to be_within(9_990_000 / 60).of(9_990_000)
+    expect(histogram.percentile(100)).to eq(10_000_000)
+    expect(histogram).to have_attributes(count: 10_000, min: 1000, max: 10_000_000)
+  end
+
+  it 'keeps small values exact' do
+    [0, 3, 3, 64, 127].each { |value| histogram.record(value) }
+
+    expect(histogram.percentile(50)).to eq(3)
+    expect(histogram.percentile(80)).to eq(64)
+  end
+
+  it 'merges another histogram' do
+    other = described_class.new
+    histogram.record(10)
+    other.record(1_000_000)
+
+    histogram.merge(other)
+
+    expect(histogram).to have_attributes(count: 2, min: 10, max: 1_000_000)
+  end
+end
@@ -0,0 +1,55 @@
+# frozen_string_literal: true
+
+require 'socket'
+require 'ruby_timeout_safe/net_http'
+
+RSpec.describe RubyTimeoutSafe::NetHTTP do
+  let(:server) { TCPServer.new('127.0.0.1', 0) }
+  let(:http) { Net::HTTP.new('127.0.0.1', server.addr[1]) }
+
+  # Answers GET /ok and never answers anything else.
+  let!(:acceptor) do
+    Thread.new do
+      loop do
+        Thread.new(server.accept) do |client|
+          request = client.gets
+          nil until client.gets == "\r\n"
+          sleep unless request.start_with?('GET /ok')
+          client.write("HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok")
+        end
+      end
+    end
+  end
+
+  after do
+    acceptor.kill
+    server.close
+  end
+
+  it 'fails a request at the socket layer when the deadline passes' do
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+    expect do
+      RubyTimeoutSafe.timeout(0.1) { http.post('/', 'x') }
+    end.to raise_error(RubyTimeoutSafe::TimeoutError) { |error| expect(error.cause).to be_a(Net::ReadTimeout) }
+    expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be < 0.3
+    expect(http).to have_attributes(read_timeout: 60, write_timeout: 60, started?: false)
+  end
+
+  it 'does not retry an idempotent request past the deadline' do
+    expect do
+      RubyTimeoutSafe.timeout(0.1) { http.get('/') }
+    end.to raise_error(RubyTimeoutSafe::TimeoutError) { |error| expect(error.scope.budget).to eq(0.1) }
+  end
+
+  it 'keeps timeouts that are already shorter' do
+    http.read_timeout = 0.05
+
+    expect { RubyTimeoutSafe.timeout(1) { http.post('/', 'x') } }.to raise_error(Net::ReadTimeout)
+  end
+
+  it 'leaves requests outside timeout scopes alone' do
+    expect(http.get('/ok').body).to eq('ok')
+    expect(RubyTimeoutSafe.timeout(1) { http.get('/ok').body }).to eq('ok')
+  end
+end
@@ -0,0 +1,64 @@
+# frozen_string_literal: true
+
+RSpec.describe RubyTimeoutSafe::Profiler do
+  subject(:profiler) { described_class.new(depth: 16) }
+
+  around do |example|
+    RubyTimeoutSafe.profiler = profiler
+    example.run
+  ensure
+    RubyTimeoutSafe.profiler = nil
+  end
+
+  def slow_path
+    sleep 1
+  end
+
+  def expire
+    yield
+  rescue RubyTimeoutSafe::TimeoutError
+    nil
+  end
+
+  it 'records where the block was when it expired, per call site' do
+    2.times { expire { RubyTimeoutSafe.timeout(0.01) { slow_path } } }
+    site = "#{__FILE__}:#{__LINE__ - 1}"
+
+    profile = profiler.to_h
+    expect(profile.keys).to eq([site])
+    expect(profile[site][:count]).to eq(2)
+    frames, count = profile[site][:stacks].first
+    expect(count).to eq(2)
+    expect(frames[0]).to include('sleep')
+    expect(frames[1]).to include('slow_path')
+  end
+
+  it 'attributes an expiry to the enclosing scope that owned the deadline' do
+    expire do
+      RubyTimeoutSafe.timeout(0.02) do
+        RubyTimeoutSafe.timeout(5) { slow_path }
+      end
+    end
+
+    expect(profiler.to_h.keys).to eq(["#{__FILE__}:#{__LINE__ - 5}"])
+  end
+
+  it 'records expiries of cooperative scopes too' do
+    RubyTimeoutSafe.timeout(0.01, mode: :cooperative) { sleep 0.05 }
+
+    expect(profiler.count).to eq(1)
+  end
+
+  it 'dumps a plain-text report' do
+    expire { RubyTimeoutSafe.timeout(0.01) { slow_path } }
+
+    expect(profiler.report).to match(/\A1 expired at .*profiler_spec\.rb:\d+\n  1x\n    .*sleep/)
+  end
+
+  it 'records nothing for blocks that finish in time' do
+    RubyTimeoutSafe.timeout(1) { nil }
+
+    expect(profiler.count).to eq(0)
+    expect(profiler.reset.to_h).to eq({})
+  end
+end
@@ -0,0 +1,52 @@
+# frozen_string_literal: true
+
+RSpec.describe RubyTimeoutSafe::Stats do
+  subject(:stats) { described_class.new }
+
+  around do |example|
+    RubyTimeoutSafe.subscribe(stats)
+    example.run
+  ensure
+    RubyTimeoutSafe.unsubscribe(stats)
+  end
+
+  def expire
+    yield
+  rescue RubyTimeoutSafe::TimeoutError
+    nil
+  end
+
+  it 'counts scopes and records how long they took' do
+    RubyTimeoutSafe.timeout(1) { RubyTimeoutSafe.timeout(2) { sleep 0.1 } }
+    expire { RubyTimeoutSafe.timeout(0.01) { sleep 1 } }
+
+    snapshot = stats.snapshot
+    expect(snapshot.slice(*described_class::COUNTERS)).to eq(started: 3, nested_skipped: 1, completed: 2, expired: 1)
+    expect(snapshot[:elapsed].percentile(100)).to be_within(20_000_000).of(100_000_000)
+    expect(snapshot[:budget_used].max).to be_within(2).of(10)
+    expect(snapshot[:overshoot].count).to eq(1)
+  end
+
+  it 'leaves scopes given no time out of budget_used' do
+    stderr = $stderr
+    $stderr = StringIO.new
+    begin
+      RubyTimeoutSafe.timeout(RubyTimeoutSafe::Deadline.at(RubyTimeoutSafe::Clock.now - 1)) { nil }
+      expect($stderr.string).to eq('')
+    ensure
+      $stderr = stderr
+    end
+
+    snapshot = stats.snapshot
+    expect(snapshot[:completed]).to eq(1)
+    expect(snapshot[:budget_used].count).to eq(0)
+  end
+
+  it 'keeps what threads recorded after they end' do
+    Array.new(4) { Thread.new { 5.times { RubyTimeoutSafe.timeout(1) { nil } } } }.each(&:join)
+
+    expect(stats.snapshot[:completed]).to eq(20)
+    RubyTimeoutSafe.timeout(1) { nil }
+    expect(stats.snapshot.values_at(:started, :completed)).to eq([21, 21])
+  end
+end
@@ -0,0 +1,53 @@
+# frozen_string_literal: true
+
+RSpec.describe RubyTimeoutSafe::ThreadPool do
+  subject(:pool) { described_class.new(size: 2) }
+
+  after { pool.shutdown }
+
+  it 'starts threads only as jobs need them' do
+    expect(pool.length).to eq(0)
+
+    done = Queue.new
+    pool.post { done << :ran }
+
+    expect(done.pop).to eq(:ran)
+    expect(pool.length).to eq(1)
+  end
+
+  it 'reuses idle threads and queues jobs beyond its size' do
+    threads = Queue.new
+    10.times { pool.post { sleep 0.01 and threads << Thread.current } }
+
+    expect(Array.new(10) { threads.pop }.uniq.size).to eq(2)
+    expect(pool.length).to eq(2)
+  end
+
+  it 'keeps its thread after a job fails' do
+    single = described_class.new(size: 1)
+    done = Queue.new
+    $stderr = StringIO.new
+    single.post { raise 'job failed' }
+    single.post { done << :ran }
+
+    expect(done.pop).to eq(:ran)
+    expect($stderr.string).to match(/pool job failed: RuntimeError: job failed/)
+    expect(single.length).to eq(1)
+  ensure
+    $stderr = STDERR
+    single&.shutdown
+  end
+
+  it 'starts threads outside threads: true scopes' do
+    done = Queue.new
+    RubyTimeoutSafe.timeout(1, threads: true) { pool.post { sleep 0.05 and done << :ran } }
+
+    expect(RubyTimeoutSafe.timeout(1) { done.pop }).to eq(:ran)
+  end
+
+  it 'refuses jobs once shut down' do
+    pool.shutdown
+
+    expect { pool.post { nil } }.to raise_error(ClosedQueueError)
+  end
+end
@@ -0,0 +1,32 @@
+# frozen_string_literal: true
+
+RSpec.describe RubyTimeoutSafe::TimerHeap do
+  subject(:heap) { described_class.new }
+
+  def timer(deadline)
+    RubyTimeoutSafe::Timer.new(Thread.current, deadline)
+  end
+
+  it 'pops timers in deadline order' do
+    [5, 1, 4, 2, 3].each { |deadline| heap.push(timer(deadline)) }
+
+    expect(Array.new(5) { heap.pop.deadline }).to eq([1, 2, 3, 4, 5])
+    expect(heap).to be_empty
+  end
+
+  it 'removes a timer from the middle of the heap' do
+    timers = (1..20).map { |deadline| heap.push(timer(deadline)) }
+    heap.delete(timers[6])
+    heap.delete(timers[13])
+
+    expect(timers[6].index).to be_nil
+    expect(Array.new(heap.size) { heap.pop.deadline }).to eq((1..20).to_a - [7, 14])
+  end
+
+  it 'ignores timers that are no longer in the heap' do
+    first = heap.push(timer(1))
+    heap.pop
+
+    expect(heap.delete(first)).to be_nil
+  end
+end
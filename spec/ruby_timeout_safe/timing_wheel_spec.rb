@@ -0,0 +1,62 @@
+# frozen_string_literal: true
+
+RSpec.describe RubyTimeoutSafe::TimingWheel do
+  subject(:wheel) { described_class.new(tick: tick) }
+
+  let(:tick) { 1_000_000 }
+  let(:now) { RubyTimeoutSafe::Clock.now }
+
+  def timer(deadline)
+    RubyTimeoutSafe::Timer.new(Thread.current, deadline)
+  end
+
+  def expired(at)
+    fired = []
+    wheel.expire(at) { |timer| fired << timer.deadline }
+    fired
+  end
+
+  it 'never fires a timer before its deadline and at most one tick after it' do
+    offsets = [0, 1, tick - 1, tick, 63 * tick, 64 * tick + 7, 5000 * tick, 300_000 * tick + 3]
+    offsets.each { |offset| wheel.push(timer(now + offset)) }
+
+    fired = {}
+    step = tick / 2
+    at = now
+    until wheel.empty?
+      wheel.expire(at) { |t| fired[t.deadline] = at }
+      at += step
+      at += 1000 * tick if wheel.next_deadline && wheel.next_deadline > at + (1000 * tick)
+    end
+
+    offsets.each do |offset|
+      deadline = now + offset
+      expect(fired[deadline]).to be >= deadline
+      expect(fired[deadline] - deadline).to be <= tick + step
+    end
+  end
+
+  it 'cancels timers on any level' do
+    near = wheel.push(timer(now + (3 * tick)))
+    far = wheel.push(timer(now + (100_000 * tick)))
+    wheel.delete(near)
+    wheel.delete(far)
+
+    expect(wheel).to be_empty
+    expect(near.bucket).to be_nil
+    expect(expired(now + (200_000 * tick))).to be_empty
+  end
+
+  it 'reports a wakeup no later than the earliest deadline' do
+    wheel.push(timer(now + (5000 * tick)))
+
+    expect(wheel.next_deadline).to be <= now + (5000 * tick)
+  end
+
+  it 'holds deadlines at the far end of the clock' do
+    wheel.push(timer(RubyTimeoutSafe::Clock::FOREVER))
+
+    expect(expired(now + (10**12))).to be_empty
+    expect(wheel.size).to eq(1)
+  end
+end
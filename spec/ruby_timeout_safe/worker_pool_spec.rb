@@ -0,0 +1,77 @@
+# frozen_string_literal: true
+
+RSpec.describe RubyTimeoutSafe::WorkerPool do
+  subject(:pool) do
+    described_class.new(size: 2, recycle_after: 3) do |job|
+      case job
+      when :hang then sleep 10
+      when :fail then raise ArgumentError, 'bad job'
+      when :deadline then RubyTimeoutSafe.current_deadline&.remaining
+      else [Process.pid, job]
+      end
+    end
+  end
+
+  before { skip 'needs fork' unless Process.respond_to?(:fork) }
+
+  after { pool.shutdown if Process.respond_to?(:fork) }
+
+  it 'runs jobs in worker processes' do
+    pid, value = pool.call(21, timeout: 1)
+
+    expect(value).to eq(21)
+    expect(pid).not_to eq(Process.pid)
+  end
+
+  it 're-raises errors from the handler' do
+    expect { pool.call(:fail, timeout: 1) }.to raise_error(ArgumentError, 'bad job')
+  end
+
+  it 'passes the deadline to the handler' do
+    expect(pool.call(:deadline, timeout: 1)).to be_within(0.2).of(1)
+  end
+
+  it 'kills and replaces a worker that overruns its deadline' do
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+    expect { pool.call(:hang, timeout: 0.1) }.to raise_error(RubyTimeoutSafe::TimeoutError)
+    expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be < 0.5
+    expect(Array.new(4) { pool.call(:ok, timeout: 1).last }).to eq(%i[ok ok ok ok])
+  end
+
+  it 'passes the deadline to workers replaced after a timeout' do
+    Array.new(2) { Thread.new { pool.call(:hang, timeout: 0.05) } }.each do |thread|
+      thread.join
+    rescue RubyTimeoutSafe::TimeoutError
+      nil
+    end
+
+    2.times { expect(pool.call(:deadline, timeout: 5)).to be_within(0.5).of(5) }
+  end
+
+  it 'times out callers waiting for a free worker' do
+    busy = Array.new(2) do
+      Thread.new do
+        pool.call(:hang, timeout: 0.3)
+      rescue RubyTimeoutSafe::TimeoutError
+        nil
+      end
+    end
+    sleep 0.05
+
+    expect { pool.call(:ok, timeout: 0.05) }.to raise_error(RubyTimeoutSafe::TimeoutError)
+    busy.each(&:join)
+  end
+
+  it 'honours an enclosing deadline' do
+    expect do
+      RubyTimeoutSafe.timeout(0.1) { pool.call(:hang, timeout: 5) }
+    end.to raise_error(RubyTimeoutSafe::TimeoutError) { |error| expect(error.scope.budget).to eq(0.1) }
+  end
+
+  it 'recycles workers after the configured number of jobs' do
+    pids = Array.new(8) { pool.call(:ok, timeout: 1).first }
+
+    expect(pids.tally.values.max).to be <= 3
+  end
+end
@@ -28,10 +28,36 @@ RSpec.describe RubyTimeoutSafe do
     end.to raise_error(RuntimeError, 'some other error')
   end
 
-  it 'raises an ArgumentError if the timeout value is less than 0.1 second' do
+  it 'raises an ArgumentError if the timeout value is negative' do
     expect do
-      RubyTimeoutSafe.timeout(0.01) { sleep 0.01 }
-    end.to raise_error(ArgumentError, 'timeout value must be at least 0.1 second')
+      RubyTimeoutSafe.timeout(-1) { sleep 0.01 }
+    end.to raise_error(ArgumentError, 'timeout value must not be negative')
+  end
+
+  [0.001, 0.01, 0.1].each do |budget|
+    it "fires a #{(budget * 1000).to_i} ms timeout no earlier than its deadline" do
+      overshoots = Array.new(5) do
+        started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        expect do
+          RubyTimeoutSafe.timeout(budget) { sleep 1 }
+        end.to raise_error(Timeout::Error)
+        Process.clock_gettime(Process::CLOCK_MONOTONIC) - started - budget
+      end.sort
+
+      expect(overshoots.first).to be >= 0
+      # Generous for loaded hosts, yet well short of the block finishing.
+      expect(overshoots.last).to be < 0.5
+    end
+  end
+
+  it 'enforces every scope with a single shared watchdog thread' do
+    RubyTimeoutSafe.timeout(1) { 42 }
+    threads = Thread.list.size
+
+    100.times { RubyTimeoutSafe.timeout(1) { 42 } }
+
+    expect(Thread.list.size).to eq(threads)
+    expect(RubyTimeoutSafe.watchdog.size).to eq(0)
   end
 
   it 'handles Bignum values for timeout' do
@@ -39,4 +65,1043 @@ RSpec.describe RubyTimeoutSafe do
       RubyTimeoutSafe.timeout(10**10) { 42 }
     end.not_to raise_error
   end
+
+  it 'never expires an infinite timeout' do
+    expect(RubyTimeoutSafe.timeout(Float::INFINITY) { 42 }).to eq(42)
+    expect(RubyTimeoutSafe.timeout(Float::INFINITY, clock: :thread_cpu) { 42 }).to eq(42)
+  end
+
+  it 'raises an ArgumentError for a NaN timeout' do
+    expect { RubyTimeoutSafe.timeout(Float::NAN) { 42 } }.to raise_error(ArgumentError, /NaN/)
+    expect { RubyTimeoutSafe.timeout(Float::NAN, clock: :thread_cpu) { 42 } }.to raise_error(ArgumentError, /NaN/)
+  end
+
+  describe '.current_deadline' do
+    it 'is nil outside any scope' do
+      expect(RubyTimeoutSafe.current_deadline).to be_nil
+    end
+
+    it 'returns the earliest deadline binding the innermost scope' do
+      RubyTimeoutSafe.timeout(0.5) do
+        outer = RubyTimeoutSafe.current_deadline
+        RubyTimeoutSafe.timeout(5) do
+          expect(RubyTimeoutSafe.current_deadline).to eq(outer)
+          expect(RubyTimeoutSafe.current_deadline.remaining).to be <= 0.5
+        end
+        RubyTimeoutSafe.timeout(0.1) do
+          expect(RubyTimeoutSafe.current_deadline).to be < outer
+        end
+      end
+    end
+
+    it 'returns the same object for repeated reads within a scope' do
+      RubyTimeoutSafe.timeout(1) do
+        expect(RubyTimeoutSafe.current_deadline).to equal(RubyTimeoutSafe.current_deadline)
+      end
+    end
+
+    it 'can bound a new scope' do
+      deadline = RubyTimeoutSafe::Deadline.in(0.05)
+
+      expect do
+        RubyTimeoutSafe.timeout(deadline) { sleep 1 }
+      end.to raise_error(RubyTimeoutSafe::TimeoutError)
+    end
+  end
+
+  describe '.budget' do
+    it 'returns the default outside any scope' do
+      expect(RubyTimeoutSafe.budget(5)).to eq(5)
+      expect(RubyTimeoutSafe.budget).to be_nil
+    end
+
+    it 'returns the time left, or the default if that is sooner' do
+      RubyTimeoutSafe.timeout(1) do
+        expect(RubyTimeoutSafe.budget(5)).to be_within(0.01).of(1)
+        expect(RubyTimeoutSafe.budget(0.2)).to eq(0.2)
+      end
+    end
+
+    it 'raises once the deadline has passed' do
+      expect do
+        RubyTimeoutSafe.timeout(0.05, mode: :cooperative) do
+          sleep 0.1
+          RubyTimeoutSafe.budget(5)
+        end
+      end.to raise_error(RubyTimeoutSafe::TimeoutError)
+    end
+
+    it 'holds the watchdog off while a client enforces the deadline' do
+      client_timeout = Class.new(StandardError)
+
+      expect do
+        RubyTimeoutSafe.timeout(0.05) do
+          RubyTimeoutSafe.budget(5) do |seconds|
+            sleep seconds
+            raise client_timeout
+          end
+        end
+      end.to raise_error(client_timeout)
+      expect(RubyTimeoutSafe.timeout(1) { RubyTimeoutSafe.budget { |seconds| seconds } }).to be_within(0.01).of(1)
+    end
+  end
+
+  describe 'checkpoints' do
+    def spin
+      loop { RubyTimeoutSafe.check! }
+    end
+
+    it 'are no-ops outside any scope' do
+      expect(RubyTimeoutSafe.expired?).to be(false)
+      expect(RubyTimeoutSafe.check!).to be_nil
+    end
+
+    it 'raise once the deadline passed in cooperative mode' do
+      expect do
+        RubyTimeoutSafe.timeout(0.05, mode: :cooperative) { spin }
+      end.to raise_error(RubyTimeoutSafe::TimeoutError) { |error| expect(error.scope.budget).to eq(0.05) }
+    end
+
+    it 'never raise asynchronously in cooperative mode' do
+      result = RubyTimeoutSafe.timeout(0.01, mode: :cooperative) do
+        sleep 0.05
+        RubyTimeoutSafe.expired?
+      end
+
+      expect(result).to be(true)
+    end
+
+    it 'observe the earliest enclosing deadline' do
+      expect do
+        RubyTimeoutSafe.timeout(0.05, mode: :cooperative) do
+          RubyTimeoutSafe.timeout(5, mode: :cooperative) { spin }
+        end
+      end.to raise_error(RubyTimeoutSafe::TimeoutError) { |error| expect(error.scope.budget).to eq(0.05) }
+    end
+
+    it 'see the deadline in raise mode once the error was delivered' do
+      expired = nil
+      begin
+        RubyTimeoutSafe.timeout(0.01) do
+          sleep 1
+        rescue RubyTimeoutSafe::TimeoutError
+          expired = RubyTimeoutSafe.expired?
+        end
+      rescue RubyTimeoutSafe::TimeoutError
+        nil
+      end
+
+      expect(expired).to be(true)
+    end
+
+    it 'still raise at the deadline of a raising scope nested in an earlier cooperative one' do
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+      expect do
+        RubyTimeoutSafe.timeout(0.05, mode: :cooperative) do
+          RubyTimeoutSafe.timeout(0.2) { sleep 1 }
+        end
+      end.to raise_error(RubyTimeoutSafe::TimeoutError) { |error| expect(error.scope.budget).to eq(0.2) }
+      expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be_within(0.05).of(0.2)
+    end
+
+    it 'disarm the raising scope when it finishes after the cooperative deadline' do
+      expired = RubyTimeoutSafe.timeout(0.05, mode: :cooperative) do
+        RubyTimeoutSafe.timeout(0.15) { sleep 0.1 }
+        sleep 0.15
+        RubyTimeoutSafe.expired?
+      end
+
+      expect(expired).to be(true)
+      expect(RubyTimeoutSafe.watchdog.size).to eq(0)
+    end
+
+    it 'rejects unknown modes' do
+      expect { RubyTimeoutSafe.timeout(1, mode: :soft) { nil } }.to raise_error(ArgumentError, /unknown mode/)
+    end
+  end
+
+  describe 'deferred delivery' do
+    it 'holds a timeout back until a critical section returns' do
+      steps = []
+      expect do
+        RubyTimeoutSafe.timeout(0.02) do
+          RubyTimeoutSafe.critical do
+            sleep 0.1
+            steps << :checked_in
+          end
+          steps << :after
+        end
+      end.to raise_error(RubyTimeoutSafe::TimeoutError)
+      expect(steps).to eq([:checked_in])
+    end
+
+    it 'returns the value of a critical section' do
+      expect(RubyTimeoutSafe.critical { 42 }).to eq(42)
+    end
+
+    it 'delivers on_blocking timeouts at the next blocking call' do
+      steps = []
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      expect do
+        RubyTimeoutSafe.timeout(0.02, mode: :on_blocking) do
+          nil until RubyTimeoutSafe.expired?
+          steps << :safe_point
+          sleep 1
+          steps << :after_sleep
+        end
+      end.to raise_error(RubyTimeoutSafe::TimeoutError)
+      expect(steps).to eq([:safe_point])
+      expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be < 0.5
+    end
+
+    it 'delivers an on_blocking timeout as the block returns if it never blocked' do
+      expect do
+        RubyTimeoutSafe.timeout(0.02, mode: :on_blocking) { nil until RubyTimeoutSafe.expired? }
+      end.to raise_error(RubyTimeoutSafe::TimeoutError)
+    end
+
+    it 'keeps critical sections inside on_blocking scopes intact' do
+      steps = []
+      expect do
+        RubyTimeoutSafe.timeout(0.02, mode: :on_blocking) do
+          RubyTimeoutSafe.critical do
+            sleep 0.05
+            steps << :released
+          end
+          sleep 1
+        end
+      end.to raise_error(RubyTimeoutSafe::TimeoutError)
+      expect(steps).to eq([:released])
+    end
+  end
+
+  describe 'io: true' do
+    let(:pipe) { IO.pipe }
+    let(:reader) { pipe.first }
+
+    before { skip 'needs Ruby 3.2' unless RubyTimeoutSafe::IOTimeout.supported? }
+
+    after { pipe.each(&:close) }
+
+    it 'times out blocking reads from the IO layer rather than the watchdog' do
+      RubyTimeoutSafe.configure(io_grace: 5)
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+      expect do
+        RubyTimeoutSafe.timeout(0.05, io: true) { reader.gets }
+      end.to raise_error(RubyTimeoutSafe::TimeoutError) { |error| expect(error.scope.budget).to eq(0.05) }
+      expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be < 1
+    ensure
+      RubyTimeoutSafe.configure(io_grace: 0.01)
+    end
+
+    it 'leaves the timeout of IOs shared with other threads alone' do
+      threads = Array.new(4) do |index|
+        Thread.new do
+          RubyTimeoutSafe.timeout(0.02 * (index + 1), io: true) { reader.gets }
+        rescue RubyTimeoutSafe::TimeoutError
+          nil
+        end
+      end
+      threads.each(&:join)
+
+      expect(pipe.map(&:timeout)).to eq([nil, nil])
+    end
+
+    it 'turns an empty wait into the timeout of the scope' do
+      expect do
+        RubyTimeoutSafe.timeout(0.05, io: true) { RubyTimeoutSafe.timeout(5) { reader.wait_readable } }
+      end.to raise_error(RubyTimeoutSafe::TimeoutError) { |error| expect(error.scope.budget).to eq(0.05) }
+    end
+
+    it 'leaves shorter IO timeouts and explicit waits alone' do
+      reader.timeout = 0.01
+
+      expect { RubyTimeoutSafe.timeout(1, io: true) { reader.gets } }.to raise_error(IO::TimeoutError)
+      expect(RubyTimeoutSafe.timeout(1, io: true) { reader.wait_readable(0.01) }).to be_nil
+    end
+
+    it 'falls back to the watchdog io_grace later for calls not bounded by a wait' do
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+      expect { RubyTimeoutSafe.timeout(0.05, io: true) { sleep 1 } }.to raise_error(RubyTimeoutSafe::TimeoutError)
+      expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be_between(0.06, 0.5)
+    end
+
+    it 'does not bound IO in critical sections' do
+      expect do
+        RubyTimeoutSafe.timeout(0.02, io: true) do
+          RubyTimeoutSafe.critical { expect(reader.wait_readable(0.05)).to be_nil }
+        end
+      end.to raise_error(RubyTimeoutSafe::TimeoutError) { |error| expect(error.cause).to be_nil }
+    end
+
+    it 'returns what the IO call read in time' do
+      pipe.last.write("line\n")
+
+      expect(RubyTimeoutSafe.timeout(1, io: true) { reader.gets }).to eq("line\n")
+    end
+
+    it 'only applies to in-process wall-clock scopes' do
+      expect { RubyTimeoutSafe.timeout(1, io: true, clock: :thread_cpu) { nil } }.to raise_error(ArgumentError, /io:/)
+    end
+  end
+
+  describe 'threads: true' do
+    let(:log) { Queue.new }
+
+    it 'binds threads started in the scope by its deadline' do
+      remaining = RubyTimeoutSafe.timeout(1, threads: true) do
+        Thread.new { RubyTimeoutSafe.current_deadline.remaining }.value
+      end
+
+      expect(remaining).to be_within(0.05).of(1)
+    end
+
+    it 'interrupts children when the deadline passes' do
+      child = nil
+      expect do
+        RubyTimeoutSafe.timeout(0.05, threads: true) do
+          child = Thread.new { sleep 5 }
+          sleep 5
+        end
+      end.to raise_error(RubyTimeoutSafe::TimeoutError)
+      expect(child).not_to be_alive
+      expect { child.value }.to raise_error(RubyTimeoutSafe::TimeoutError)
+    end
+
+    it 'cancels children still running when the scope ends and waits for them' do
+      RubyTimeoutSafe.timeout(1, threads: true) do
+        Thread.new do
+          sleep 5
+        rescue RubyTimeoutSafe::CancelledError => e
+          log << e.scope.budget
+          raise
+        end
+        sleep 0.02
+      end
+
+      expect(log.size).to eq(1)
+      expect(log.pop).to eq(1)
+    end
+
+    it 'owns threads in a scope with no timeout' do
+      RubyTimeoutSafe.timeout(nil, threads: true) do
+        Thread.new do
+          log << (RubyTimeoutSafe.current_deadline.remaining > 3600)
+          sleep 5
+        rescue RubyTimeoutSafe::CancelledError
+          log << :cancelled
+          raise
+        end
+        sleep 0.02
+      end
+
+      expect(Array.new(log.size) { log.pop }).to eq([true, :cancelled])
+    end
+
+    it 'lets children finish critical sections before cancelling them' do
+      child = nil
+      RubyTimeoutSafe.timeout(1, threads: true) do
+        child = Thread.new do
+          RubyTimeoutSafe.critical do
+            log << :started
+            sleep 0.05
+            log << :finished
+          end
+          log << :after
+        end
+        log.pop
+      end
+
+      expect(log.pop).to eq(:finished)
+      expect(log).to be_empty
+      expect(child.value).to be_nil
+    end
+
+    it 'owns threads started by the children too' do
+      grandchild = nil
+      RubyTimeoutSafe.timeout(1, threads: true) do
+        Thread.new { grandchild = Thread.new { sleep 5 } and sleep 5 }
+        sleep 0.02
+      end
+
+      expect(grandchild).not_to be_alive
+    end
+
+    it 'does not hold up an enclosing deadline while waiting for children' do
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      expect do
+        RubyTimeoutSafe.timeout(0.1) do
+          RubyTimeoutSafe.timeout(5, threads: true) do
+            Thread.new { RubyTimeoutSafe.critical { sleep 0.5 } }
+            sleep 0.01
+          end
+          :finished
+        end
+      end.to raise_error(RubyTimeoutSafe::TimeoutError) { |error| expect(error.scope.budget).to eq(0.1) }
+      expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be < 0.3
+    end
+
+    it 'kills children that are still running cancel_grace after being cancelled' do
+      RubyTimeoutSafe.configure(cancel_grace: 0.05)
+      child = nil
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      RubyTimeoutSafe.timeout(5, threads: true) do
+        child = Thread.new do
+          loop do
+            sleep 5
+          rescue RubyTimeoutSafe::CancelledError
+            nil
+          end
+        end
+        sleep 0.01
+      end
+
+      expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be < 0.3
+      expect(child.join(1)).to be(child)
+    ensure
+      RubyTimeoutSafe.configure(cancel_grace: 1)
+    end
+
+    it 'leaves untracked threads alone' do
+      thread = RubyTimeoutSafe.timeout(1, threads: true) do
+        RubyTimeoutSafe.untracked { Thread.new { sleep 0.05 and :kept } }
+      end
+
+      expect(thread.value).to eq(:kept)
+    end
+
+    it 'only applies to in-process wall-clock scopes' do
+      expect { RubyTimeoutSafe.timeout(1, threads: true, isolate: :process) { nil } }.to raise_error(ArgumentError, /threads:/)
+    end
+  end
+
+  describe '.map' do
+    let(:pool) { RubyTimeoutSafe::ThreadPool.new(size: 4) }
+
+    after { pool.shutdown }
+
+    def elapsed
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      yield
+      Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+    end
+
+    it 'maps items concurrently' do
+      result = nil
+      duration = elapsed do
+        result = RubyTimeoutSafe.map(1..8, concurrency: 4, pool: pool) { |item| sleep 0.05 and item * 2 }
+      end
+
+      expect(result.values).to eq((1..8).map { |item| item * 2 })
+      expect(result).to be_complete
+      expect(duration).to be < 0.2
+    end
+
+    it 'reports items that outrun per_item as timed out, by position' do
+      result = RubyTimeoutSafe.map([0.01, 5, 0.01, 5], per_item: 0.05, pool: pool) { |seconds| sleep seconds and seconds }
+
+      expect(result.values).to eq([0.01, nil, 0.01, nil])
+      expect(result.timed_out).to eq([1, 3])
+    end
+
+    it 'keeps results for equal items apart' do
+      result = RubyTimeoutSafe.map(%w[a b a a], concurrency: 3, pool: pool) { |item| item.upcase }
+
+      expect(result.values).to eq(%w[A B A A])
+    end
+
+    it 'returns at the overall deadline with whatever finished' do
+      result = nil
+      duration = elapsed do
+        result = RubyTimeoutSafe.map(1..40, timeout: 0.1, concurrency: 2, pool: pool) { |item| sleep 0.03 and item }
+      end
+
+      expect(duration).to be_within(0.05).of(0.1)
+      expect(result.values.compact.size).to be_between(4, 8)
+      expect(result.values.compact.size + result.timed_out.size).to eq(40)
+    end
+
+    it 'collects errors raised by the block' do
+      result = RubyTimeoutSafe.map(1..3, pool: pool) { |item| item == 2 ? raise(ArgumentError, 'bad item') : item }
+
+      expect(result.values).to eq([1, nil, 3])
+      expect(result.errors.keys).to eq([1])
+      expect(result.errors[1].message).to eq('bad item')
+    end
+
+    it 'works through many items on a bounded number of threads' do
+      threads = Queue.new
+      result = RubyTimeoutSafe.map(1..2000, timeout: 5, concurrency: 4, pool: pool) { |item| threads << Thread.current and item }
+
+      expect(result.values).to eq((1..2000).to_a)
+      expect(Array.new(threads.size) { threads.pop }.uniq.size).to be <= 4
+      expect(pool.length).to eq(3)
+    end
+
+    it 'is bound by an enclosing deadline, which still raises' do
+      expect do
+        RubyTimeoutSafe.timeout(0.05) { RubyTimeoutSafe.map(1..4, concurrency: 1, pool: pool) { sleep 5 } }
+      end.to raise_error(RubyTimeoutSafe::TimeoutError) { |error| expect(error.scope.budget).to eq(0.05) }
+    end
+
+    it 'runs nested maps without waiting for pool threads' do
+      result = RubyTimeoutSafe.map(1..4, timeout: 1, concurrency: 4, pool: RubyTimeoutSafe::ThreadPool.new(size: 1)) do |item|
+        RubyTimeoutSafe.map(1..4, concurrency: 4, pool: pool) { |factor| item * factor }.values.sum
+      end
+
+      expect(result.values).to eq([10, 20, 30, 40])
+    end
+
+    it 'rejects a concurrency below one' do
+      expect { RubyTimeoutSafe.map([1], concurrency: 0) { nil } }.to raise_error(ArgumentError, /concurrency/)
+    end
+  end
+
+  describe 'allocations' do
+    it 'allocates no objects for blocks that finish in time' do
+      call = -> { 1000.times { RubyTimeoutSafe.timeout(1) { nil } } }
+
+      expect(allocated_objects(&call)).to eq(0)
+    end
+
+    it 'allocates no objects for nested scopes that finish in time' do
+      call = lambda do
+        1000.times { RubyTimeoutSafe.timeout(1) { RubyTimeoutSafe.timeout(0.5) { RubyTimeoutSafe.timeout(2) { nil } } } }
+      end
+
+      expect(allocated_objects(&call)).to eq(0)
+    end
+
+    it 'keeps the scope of a raised error intact after it is recycled' do
+      error = nil
+      begin
+        RubyTimeoutSafe.timeout(0.01) { sleep 1 }
+      rescue RubyTimeoutSafe::TimeoutError => e
+        error = e
+      end
+      RubyTimeoutSafe.timeout(5) { RubyTimeoutSafe.timeout(6) { nil } }
+
+      expect(error.scope.budget).to eq(0.01)
+    end
+  end
+
+  describe 'nested scopes' do
+    it 'arms nothing for an inner scope that ends after the enclosing one' do
+      armed = RubyTimeoutSafe.timeout(1) do
+        RubyTimeoutSafe.timeout(5) { RubyTimeoutSafe.watchdog.size }
+      end
+
+      expect(armed).to eq(1)
+    end
+
+    it 'reports the inner scope when its earlier deadline passes' do
+      error = nil
+      RubyTimeoutSafe.timeout(2) do
+        RubyTimeoutSafe.timeout(0.05) { sleep 1 }
+      rescue RubyTimeoutSafe::TimeoutError => e
+        error = e
+      end
+
+      expect(error.scope).to have_attributes(depth: 1, budget: 0.05)
+      expect(error.message).to eq('execution expired')
+    end
+
+    it 'reports the enclosing scope when it expires inside an inner scope' do
+      expect do
+        RubyTimeoutSafe.timeout(0.05) do
+          RubyTimeoutSafe.timeout(5) { sleep 1 }
+        end
+      end.to raise_error(RubyTimeoutSafe::TimeoutError) { |error| expect(error.scope.depth).to eq(0) }
+    end
+
+    it 're-arms the enclosing deadline once an earlier inner scope finishes' do
+      expect do
+        RubyTimeoutSafe.timeout(0.1) do
+          RubyTimeoutSafe.timeout(0.05) { :done }
+          sleep 1
+        end
+      end.to raise_error(RubyTimeoutSafe::TimeoutError) { |error| expect(error.scope.budget).to eq(0.1) }
+      expect(RubyTimeoutSafe.watchdog.size).to eq(0)
+      expect(RubyTimeoutSafe.current_scope).to be_nil
+    end
+
+    # Each inner block spins until its deadline, so its TimeoutError arrives
+    # while the scope is being left.
+    it 'keeps the enclosing deadline armed under inner scopes expiring as they end' do
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+      expect do
+        RubyTimeoutSafe.timeout(0.5) do
+          2_000.times do
+            RubyTimeoutSafe.timeout(0.0001) { nil until RubyTimeoutSafe.current_deadline.expired? }
+          rescue RubyTimeoutSafe::TimeoutError => e
+            raise if e.scope.budget == 0.5
+          end
+          sleep 5
+        end
+      end.to raise_error(RubyTimeoutSafe::TimeoutError) { |error| expect(error.scope.budget).to eq(0.5) }
+      expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be < 1.5
+      expect(RubyTimeoutSafe.current_scope).to be_nil
+      expect(RubyTimeoutSafe.watchdog.size).to eq(0)
+    end
+  end
+
+  describe 'soft deadlines' do
+    let(:warnings) { Queue.new }
+    let(:on_soft) { ->(scope, thread) { warnings << [scope.budget, thread.backtrace_locations.map(&:label)] } }
+
+    it 'calls on_soft with a backtrace of the running block and lets it finish' do
+      result = RubyTimeoutSafe.timeout(0.5, soft: 0.02, on_soft: on_soft) { sleep 0.1 and :finished }
+
+      expect(result).to eq(:finished)
+      budget, labels = warnings.pop
+      expect(budget).to eq(0.5)
+      expect(labels).to include('sleep')
+    end
+
+    it 'still raises at the hard deadline from the same watchdog entry' do
+      expect do
+        RubyTimeoutSafe.timeout(0.1, soft: 0.02, on_soft: ->(*) { warnings << RubyTimeoutSafe.watchdog.size }) { sleep 1 }
+      end.to raise_error(RubyTimeoutSafe::TimeoutError)
+      expect(warnings.pop).to eq(1)
+      expect(RubyTimeoutSafe.watchdog.size).to eq(0)
+    end
+
+    it 'does not call on_soft for blocks that finish before it' do
+      RubyTimeoutSafe.timeout(1, soft: 0.05, on_soft: on_soft) { nil }
+      sleep 0.1
+
+      expect(warnings).to be_empty
+    end
+
+    it 'restores an enclosing soft deadline after an inner scope armed an earlier hard one' do
+      RubyTimeoutSafe.timeout(1, soft: 0.05, on_soft: on_soft) do
+        RubyTimeoutSafe.timeout(0.02) { nil }
+        sleep 0.1
+      end
+
+      expect(warnings.pop.first).to eq(1)
+    end
+
+    it 'requires a callback' do
+      expect { RubyTimeoutSafe.timeout(1, soft: 0.5) { nil } }.to raise_error(ArgumentError, /on_soft/)
+    end
+  end
+
+  describe 'subscribers' do
+    let(:events) { [] }
+
+    def subscribed
+      subscriber = RubyTimeoutSafe.subscribe { |event| events << event }
+      yield
+    ensure
+      RubyTimeoutSafe.unsubscribe(subscriber)
+    end
+
+    def expire
+      yield
+    rescue RubyTimeoutSafe::TimeoutError
+      nil
+    end
+
+    it 'publishes start and complete with the elapsed time and budget used' do
+      subscribed { RubyTimeoutSafe.timeout(1) { sleep 0.05 } }
+
+      expect(events.map(&:type)).to eq(%i[start complete])
+      expect(events.last.elapsed).to be_within(20_000_000).of(50_000_000)
+      expect(events.last.budget_used).to be_within(0.02).of(0.05)
+    end
+
+    it 'publishes nested skips and the expiry with its overshoot' do
+      subscribed do
+        expire { RubyTimeoutSafe.timeout(0.02) { RubyTimeoutSafe.timeout(5) { sleep 1 } } }
+      end
+
+      expect(events.map { |event| [event.type, event.budget] })
+        .to eq([[:start, 0.02], [:start, 5], [:nested_skip, 5], [:complete, 5], [:expire, 0.02]])
+      expect(events.last.overshoot).to be_between(0, 50_000_000)
+    end
+
+    it 'publishes expiries of cooperative scopes that overran' do
+      subscribed { RubyTimeoutSafe.timeout(0.01, mode: :cooperative) { sleep 0.05 } }
+
+      expect(events.map(&:type)).to eq(%i[start expire])
+    end
+
+    it 'publishes expiries of scopes a fiber scheduler enforced' do
+      subscribed do
+        Thread.new do
+          Fiber.set_scheduler(FiberScheduler.new)
+          Fiber.schedule { expire { RubyTimeoutSafe.timeout(0.01) { sleep 1 } } }
+        end.join
+      end
+
+      expect(events.map(&:type)).to eq(%i[start expire])
+    end
+
+    it 'keeps running the block when a subscriber fails' do
+      stderr = $stderr
+      $stderr = StringIO.new
+      broken = RubyTimeoutSafe.subscribe { raise 'broken' }
+
+      expect(RubyTimeoutSafe.timeout(1) { 42 }).to eq(42)
+      expect($stderr.string).to match(/subscriber failed on start: RuntimeError: broken/)
+    ensure
+      RubyTimeoutSafe.unsubscribe(broken)
+      $stderr = stderr
+    end
+
+    it 'allocates nothing once everyone unsubscribed' do
+      subscribed { nil }
+
+      expect(allocated_objects { 1000.times { RubyTimeoutSafe.timeout(1) { nil } } }).to eq(0)
+    end
+  end
+
+  describe 'clock: :thread_cpu' do
+    def cpu_time
+      Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID)
+    end
+
+    it 'does not count time the thread spends blocked' do
+      expect(RubyTimeoutSafe.timeout(0.05, clock: :thread_cpu) { sleep 0.2 and :slept }).to eq(:slept)
+    end
+
+    it 'raises once the thread used up its CPU budget' do
+      started = cpu_time
+
+      expect do
+        RubyTimeoutSafe.timeout(0.05, clock: :thread_cpu) { loop { nil } }
+      end.to raise_error(RubyTimeoutSafe::TimeoutError) { |error| expect(error.scope.budget).to eq(0.05) }
+      expect(cpu_time - started).to be >= 0.05
+      expect(RubyTimeoutSafe.watchdog.size).to eq(0)
+    end
+
+    it 'keeps measuring while other threads take the CPU' do
+      busy = Thread.new do
+        RubyTimeoutSafe.timeout(0.3) { loop { nil } }
+      rescue RubyTimeoutSafe::TimeoutError
+        nil
+      end
+      started = cpu_time
+
+      expect do
+        RubyTimeoutSafe.timeout(0.05, clock: :thread_cpu) { loop { nil } }
+      end.to raise_error(RubyTimeoutSafe::TimeoutError)
+      expect(cpu_time - started).to be >= 0.05
+      busy.join
+    end
+
+    it 'rejects combinations it cannot enforce' do
+      expect { RubyTimeoutSafe.timeout(1, clock: :thread_cpu, mode: :cooperative) { nil } }.to raise_error(ArgumentError)
+      expect { RubyTimeoutSafe.timeout(1, clock: :wall) { nil } }.to raise_error(ArgumentError, /unknown clock/)
+    end
+  end
+
+  describe 'isolate: :process' do
+    before { skip 'needs fork' unless Process.respond_to?(:fork) }
+
+    # Killed, or a zombie left for a reaper other than us.
+    def gone?(pid)
+      File.read("/proc/#{pid}/stat").split[2] == 'Z'
+    rescue Errno::ENOENT
+      true
+    end
+
+    it 'returns the value of the block computed in a child process' do
+      pid, value = RubyTimeoutSafe.timeout(2, isolate: :process) { [Process.pid, 42] }
+
+      expect(value).to eq(42)
+      expect(pid).not_to eq(Process.pid)
+    end
+
+    it 're-raises the error of the block' do
+      expect do
+        RubyTimeoutSafe.timeout(2, isolate: :process) { raise ArgumentError, 'bad input' }
+      end.to raise_error(ArgumentError, 'bad input')
+    end
+
+    it 'kills a block that cannot be interrupted in-thread' do
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      child = nil
+
+      expect do
+        RubyTimeoutSafe.timeout(0.1, isolate: :process) do
+          Thread.handle_interrupt(Object => :never) { sleep 5 }
+        end
+      end.to raise_error(RubyTimeoutSafe::TimeoutError) { |error| child = error.scope }
+      expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be < 0.5
+      expect(child.budget).to eq(0.1)
+    end
+
+    it 'kills the whole process group of the child' do
+      skip 'needs /proc' unless File.directory?('/proc/self')
+      reader, writer = IO.pipe
+      expect do
+        RubyTimeoutSafe.timeout(0.1, isolate: :process) do
+          writer.puts(spawn('sleep', '5'))
+          writer.flush
+          sleep 5
+        end
+      end.to raise_error(RubyTimeoutSafe::TimeoutError)
+      grandchild = Integer(reader.gets)
+      sleep 0.05
+
+      expect(gone?(grandchild)).to be(true)
+    ensure
+      reader&.close
+      writer&.close
+    end
+
+    it 'exposes the deadline inside the child' do
+      remaining = RubyTimeoutSafe.timeout(1, isolate: :process) { RubyTimeoutSafe.current_deadline.remaining }
+
+      expect(remaining).to be_within(0.2).of(1)
+    end
+
+    it 're-raises a nested scope expiring in the child without its scope' do
+      expect do
+        RubyTimeoutSafe.timeout(2, isolate: :process) do
+          RubyTimeoutSafe.timeout(0.05, soft: 0.01, on_soft: ->(*) {}, threads: true) { sleep 1 }
+        end
+      end.to raise_error(RubyTimeoutSafe::TimeoutError) { |error| expect(error.scope).to be_nil }
+    end
+
+    it 'reports results that cannot be marshalled' do
+      expect do
+        RubyTimeoutSafe.timeout(2, isolate: :process) { -> {} }
+      end.to raise_error(RubyTimeoutSafe::IsolationError, /cannot return Proc/)
+    end
+
+    it 'reports a child that dies without a result' do
+      expect do
+        RubyTimeoutSafe.timeout(2, isolate: :process) { exit!(3) }
+      end.to raise_error(RubyTimeoutSafe::IsolationError, /exited without a result/)
+    end
+  end
+
+  describe 'inside a non-blocking fiber' do
+    def with_scheduler
+      Thread.new do
+        Fiber.set_scheduler(FiberScheduler.new)
+        yield
+      end.join
+    end
+
+    it 'delegates the deadline to the fiber scheduler and cancels only that fiber' do
+      events = []
+      with_scheduler do
+        Fiber.schedule do
+          RubyTimeoutSafe.timeout(0.05) do
+            events << [:armed, RubyTimeoutSafe.watchdog.size]
+            sleep 1
+          end
+        rescue RubyTimeoutSafe::TimeoutError => e
+          events << [:expired, e.scope.budget]
+        end
+        Fiber.schedule do
+          sleep 0.1
+          events << :sibling_finished
+        end
+      end
+
+      expect(events).to eq([[:armed, 0], [:expired, 0.05], :sibling_finished])
+    end
+
+    it 'returns the value of the block' do
+      result = nil
+      with_scheduler do
+        Fiber.schedule { result = RubyTimeoutSafe.timeout(1) { 42 } }
+      end
+
+      expect(result).to eq(42)
+    end
+
+    it 'hands on_blocking scopes to the scheduler too' do
+      armed = nil
+      with_scheduler do
+        Fiber.schedule { armed = RubyTimeoutSafe.timeout(1, mode: :on_blocking) { RubyTimeoutSafe.watchdog.size } }
+      end
+
+      expect(armed).to eq(0)
+    end
+
+    it 'flags cooperative scopes through the watchdog' do
+      expired = nil
+      with_scheduler do
+        Fiber.schedule do
+          expired = RubyTimeoutSafe.timeout(0.01, mode: :cooperative) do
+            sleep 0.05
+            RubyTimeoutSafe.expired?
+          end
+        end
+      end
+
+      expect(expired).to be(true)
+    end
+  end
+
+  RubyTimeoutSafe.engines.each do |engine|
+    context "with the #{engine} engine" do
+      around do |example|
+        RubyTimeoutSafe.configure(engine: engine)
+        example.run
+      ensure
+        RubyTimeoutSafe.configure(engine: :auto)
+      end
+
+      it 'raises a Timeout::Error when the block overruns' do
+        expect do
+          RubyTimeoutSafe.timeout(0.2) { sleep 100 }
+        end.to raise_error(Timeout::Error, 'execution expired')
+      end
+
+      it 'wakes up at the deadline instead of polling for it' do
+        started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+        expect do
+          RubyTimeoutSafe.timeout(0.2) { sleep 100 }
+        end.to raise_error(Timeout::Error)
+        expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be < 0.23
+      end
+
+      it 'enforces the earliest of several concurrent deadlines' do
+        long = Thread.new { RubyTimeoutSafe.timeout(5) { sleep 0.5 and :finished } }
+        started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+        expect do
+          RubyTimeoutSafe.timeout(0.2) { sleep 100 }
+        end.to raise_error(Timeout::Error)
+        expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be < 0.4
+        expect(long.value).to eq(:finished)
+      end
+    end
+  end
+
+  describe '.configure' do
+    def watchdog_threads
+      Thread.list.count { |thread| thread.name == 'ruby_timeout_safe' && thread.alive? }
+    end
+
+    it 'ends the thread of each watchdog it replaces' do
+      RubyTimeoutSafe.timeout(1) { nil }
+      before = watchdog_threads
+
+      20.times do
+        RubyTimeoutSafe.configure(store: :heap)
+        RubyTimeoutSafe.timeout(1) { nil }
+      end
+      sleep 0.05
+
+      expect(watchdog_threads).to eq(before)
+    end
+
+    it 'keeps the replaced watchdog until the scopes running on it finish' do
+      expect do
+        RubyTimeoutSafe.timeout(0.1) do
+          RubyTimeoutSafe.configure(store: :heap)
+          sleep 1
+        end
+      end.to raise_error(RubyTimeoutSafe::TimeoutError)
+    end
+
+    it 'leaves the watchdog alone when a setting is invalid' do
+      watchdog = RubyTimeoutSafe.watchdog
+
+      expect { RubyTimeoutSafe.configure(store: :list) }.to raise_error(ArgumentError)
+      expect(RubyTimeoutSafe.watchdog).to be(watchdog)
+      expect { RubyTimeoutSafe.timeout(0.05) { sleep 1 } }.to raise_error(RubyTimeoutSafe::TimeoutError)
+    end
+  end
+
+  context 'with the timing wheel store' do
+    around do |example|
+      RubyTimeoutSafe.configure(store: :wheel)
+      example.run
+    ensure
+      RubyTimeoutSafe.configure(store: :heap)
+    end
+
+    it 'raises a Timeout::Error when the block overruns' do
+      expect do
+        RubyTimeoutSafe.timeout(0.2) { sleep 100 }
+      end.to raise_error(Timeout::Error, 'execution expired')
+    end
+
+    it 'handles Bignum values for timeout' do
+      expect(RubyTimeoutSafe.timeout(10**10) { 42 }).to eq(42)
+    end
+  end
+
+  context 'with signal interruption' do
+    around do |example|
+      skip 'needs the native extension on Linux' unless RubyTimeoutSafe.signals?
+      RubyTimeoutSafe.configure(signal: true, signal_interval: 0.02)
+      example.run
+    ensure
+      RubyTimeoutSafe.configure(signal: false)
+    end
+
+    # libc sleep(3) through Fiddle: a native call Thread#raise cannot cut short.
+    def native_sleep(seconds)
+      require 'fiddle'
+      Fiddle::Function.new(Fiddle.dlopen(nil)['sleep'], [Fiddle::TYPE_INT], Fiddle::TYPE_INT).call(seconds)
+    end
+
+    it 'interrupts a blocking native call' do
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+      expect do
+        RubyTimeoutSafe.timeout(0.05) { native_sleep(5) }
+      end.to raise_error(RubyTimeoutSafe::TimeoutError)
+      expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be < 1
+    end
+
+    it 'sends no signal to blocks that finish in time' do
+      expect(RubyTimeoutSafe.timeout(0.05) { 42 }).to eq(42)
+      expect(native_sleep(0)).to eq(0)
+      sleep 0.1
+    end
+
+    it 'leaves cooperative scopes alone' do
+      result = RubyTimeoutSafe.timeout(0.01, mode: :cooperative) { native_sleep(1) }
+
+      expect(result).to eq(0)
+    end
+
+    it 'sends no signals inside a critical section' do
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+      expect do
+        RubyTimeoutSafe.timeout(0.05) { RubyTimeoutSafe.critical { native_sleep(1) } }
+      end.to raise_error(RubyTimeoutSafe::TimeoutError)
+      expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be >= 0.9
+    end
+
+    it 'sends no signals inside an on_blocking scope' do
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+      begin
+        RubyTimeoutSafe.timeout(0.05, mode: :on_blocking) { native_sleep(1) }
+      rescue RubyTimeoutSafe::TimeoutError
+        nil
+      end
+      expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be >= 0.9
+    end
+
+    it 'signals again once a critical section ends' do
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+      expect do
+        RubyTimeoutSafe.timeout(0.05) do
+          RubyTimeoutSafe.critical { nil }
+          native_sleep(5)
+        end
+      end.to raise_error(RubyTimeoutSafe::TimeoutError)
+      expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be < 1
+    end
+  end
 end
@@ -0,0 +1,17 @@
+# frozen_string_literal: true
+
+module AllocationHelpers
+  # Runs the block once to warm up caches (and GC.stat itself), then counts
+  # the objects allocated by a second run.
+  def allocated_objects
+    2.times.map do
+      before = GC.stat(:total_allocated_objects)
+      yield
+      GC.stat(:total_allocated_objects) - before
+    end.last
+  end
+end
+
+RSpec.configure do |config|
+  config.include AllocationHelpers
+end
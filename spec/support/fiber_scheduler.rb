@@ -0,0 +1,72 @@
+# frozen_string_literal: true
+
+# A minimal non-blocking Fiber::Scheduler for specs: fibers sleep, block and
+# time out on a single timer list driven from #run.
+class FiberScheduler
+  def initialize
+    @ready = []
+    @timers = []
+    @blocked = {}
+  end
+
+  def run
+    until @ready.empty? && @timers.empty?
+      @ready.shift.resume until @ready.empty?
+      next if @timers.empty?
+
+      @timers.sort_by!(&:first)
+      at, fiber, action = @timers.first
+      delay = at - now
+      sleep(delay) if delay.positive?
+      @timers.shift
+      action ? action.call : (fiber.resume if fiber.alive?)
+    end
+  end
+
+  def close
+    run
+  end
+
+  def fiber(&block)
+    fiber = Fiber.new(blocking: false, &block)
+    fiber.resume
+    fiber
+  end
+
+  def kernel_sleep(duration = nil)
+    block(nil, duration)
+  end
+
+  def block(_blocker, timeout = nil)
+    fiber = Fiber.current
+    timer = [now + timeout, fiber] if timeout
+    @timers << timer if timer
+    @blocked[fiber] = true
+    Fiber.yield
+  ensure
+    @blocked.delete(fiber)
+    @timers.delete(timer) if timer
+  end
+
+  def unblock(_blocker, fiber)
+    @ready << fiber if @blocked.key?(fiber)
+  end
+
+  def io_wait(_io, events, _timeout)
+    events
+  end
+
+  def timeout_after(duration, exception, message)
+    fiber = Fiber.current
+    timer = [now + duration, fiber, -> { fiber.raise(exception, message) if fiber.alive? }]
+    @timers << timer
+    yield duration
+  ensure
+    @timers.delete(timer)
+  end
+
+  private
+    def now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+end